@@ -37,6 +37,39 @@ Date *date_create(char *datestr){
 	return newdate;
 }
 
+/*
+ * date_create_dmy creates a Date structure from numeric day, month and year
+ * fields, as found when parsing timestamps in other layouts
+ * returns pointer to Date structure if successful,
+ *         NULL if not (field out of range or memory allocation failure)
+ */
+Date *date_create_dmy(int day, int month, int year){
+	// Only what fits the two- and four-digit fields of "dd/mm/yyyy"
+	if ( (day < 1) | (day > 31)
+	     | (month < 1) | (month > 12)
+	     | (year < 0) | (year > 9999)
+	   )
+		return 0;
+
+	Date *newdate = (Date *) malloc(sizeof(Date));
+
+	if (newdate == 0)
+		return 0;
+
+	// Same char-digit layout as date_create, by order of significance
+	newdate->sig[0] = '0' + year / 1000;
+	newdate->sig[1] = '0' + year / 100 % 10;
+	newdate->sig[2] = '0' + year / 10 % 10;
+	newdate->sig[3] = '0' + year % 10;
+	newdate->sig[4] = '0' + month / 10;
+	newdate->sig[5] = '0' + month % 10;
+	newdate->sig[6] = '0' + day / 10;
+	newdate->sig[7] = '0' + day % 10;
+
+	// Return
+	return newdate;
+}
+
 /*
  * date_duplicate creates a duplicate of `d'
  * returns pointer to new Date structure if successful,
@@ -61,7 +94,8 @@ Date *date_duplicate(Date *d){
  * date1<date2, date1==date2, date1>date2, respectively
  */
 int date_compare(Date *date1, Date *date2){
-	return strcmp(date1->sig, date2->sig);}
+	// sig isn't NUL-terminated, so compare exactly its digits
+	return memcmp(date1->sig, date2->sig, sizeof(date1->sig));}
 
 /*
  * date_destroy returns any storage associated with `d' to the system
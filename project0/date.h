@@ -14,6 +14,14 @@ typedef struct date Date;
  */
 Date *date_create(char *datestr);
 
+/*
+ * date_create_dmy creates a Date structure from numeric day, month and year
+ * fields, as found when parsing timestamps in other layouts
+ * returns pointer to Date structure if successful,
+ *         NULL if not (field out of range or memory allocation failure)
+ */
+Date *date_create_dmy(int day, int month, int year);
+
 /*
  * date_duplicate creates a duplicate of `d'
  * returns pointer to new Date structure if successful,
@@ -1,7 +1,17 @@
 
 
 #include "tldlist.h"
+#include <pthread.h>
 
+/*
+ * Snapshots work by generation. Every node is stamped with the generation
+ * it was created in, and taking a snapshot closes the current generation.
+ * A writer only ever modifies nodes of the current generation in place;
+ * anything older might be visible to a snapshot, so it's copied first and
+ * the original is parked on the retired list until no snapshot that could
+ * still see it remains. The lock is only held for O(1) work by readers, so
+ * tldlist_add never waits on a reader walking the tree.
+ */
 struct tldlist {
 	TLDNode *root;
 	int total;
@@ -9,6 +19,13 @@ struct tldlist {
 
 	Date *begin;
 	Date *end;
+
+	pthread_mutex_t lock;
+	unsigned long gen;
+	TLDIterator *readers;	// live snapshots, oldest first
+	TLDIterator *last_reader;
+	TLDNode *retired;	// superseded nodes, oldest first
+	TLDNode *last_retired;
 };
 
 struct tldnode {
@@ -18,12 +35,20 @@ struct tldnode {
 	
 	char *domain;
 	int frequency;
+
+	unsigned long gen;	// generation the node was created in
+	TLDNode *next_retired;
 };
 
 struct tlditerator {
 	int index;
 	int max;
 	TLDNode **inorder;
+
+	TLDList *owner;
+	unsigned long gen;
+	long total;
+	TLDIterator *next;
 };
 
 //------------------ Internal Utility Functions --------------------
@@ -36,11 +61,18 @@ struct tlditerator {
  * a frequency count of 1. Returns the address of the new node if
  * successful, NULL otherwise.
  */
-TLDNode *tldnode_create(char *d){
+TLDNode *tldnode_create(char *d, unsigned long gen){
 	TLDNode *newnode = (TLDNode *) malloc(sizeof(TLDNode));
+
+	if (newnode == 0)
+		return 0;
 	
 	// Allocate memory for the domain name and copy it in
-	newnode->domain = (char *) malloc(strlen(d));
+	newnode->domain = (char *) malloc(strlen(d) + 1);
+	if (newnode->domain == 0){
+		free(newnode);
+		return 0;
+	}
 	strcpy(newnode->domain, d);
 	
 	// Set the child pointers to NULL
@@ -49,11 +81,66 @@ TLDNode *tldnode_create(char *d){
 
 	// Set the node's height to 1, as it's a leaf upon creation
 	newnode->height = 1;
+	newnode->frequency = 1;
+
+	newnode->gen = gen;
+	newnode->next_retired = 0;
 
 	// Return
 	return newnode;
 }
 
+/*
+ * tldnode_writable returns a version of `node' that the writer may modify
+ * in place. Nodes from the current generation are returned as they are;
+ * older ones may be reachable from a snapshot, so they're copied and the
+ * original is retired. The copy shares the original's domain string.
+ * Returns NULL if the copy can't be made, leaving the original in place.
+ */
+TLDNode *tldnode_writable(TLDList *tld, TLDNode *node){
+	if (node == 0 || node->gen == tld->gen)
+		return node;
+
+	TLDNode *copy = (TLDNode *) malloc(sizeof(TLDNode));
+	if (copy == 0)
+		return 0;
+	memcpy(copy, node, sizeof(TLDNode));
+	copy->gen = tld->gen;
+	copy->next_retired = 0;
+
+	// Retire the original, stamped with the generation that replaced it
+	node->gen = tld->gen;
+	if (tld->last_retired == 0)
+		tld->retired = node;
+	else
+		tld->last_retired->next_retired = node;
+	tld->last_retired = node;
+
+	return copy;
+}
+
+/*
+ * tld_reclaim frees retired nodes that no live snapshot can reach anymore.
+ * A node retired in generation g is only visible to snapshots older than g.
+ * Must be called with the list's lock held.
+ */
+void tld_reclaim(TLDList *tld){
+	while (tld->retired != 0 && (tld->readers == 0
+	       || tld->retired->gen <= tld->readers->gen)){
+		TLDNode *garbage = tld->retired;
+		tld->retired = garbage->next_retired;
+		free(garbage);	// domain belongs to the live copy
+	}
+
+	if (tld->retired == 0)
+		tld->last_retired = 0;
+}
+
+// Helper function for height lookups that tolerates empty subtrees
+int node_height(TLDNode *node){
+	return (node == 0)? 0 : node->height;
+}
+
 // Helper function for height updates
 int max_height(TLDNode *a, TLDNode *b){
 	if ((a == 0) && (b == 0))
@@ -109,23 +196,44 @@ TLDNode *rotate_left(TLDNode *target){
  * the count. Otherwise, it attaches a new node to the appropriate child
  * with that domain and rebalances on its way back if necessary.
  *
- * DEVNOTE: The only reason we need to pass along the TLDList is to increment
- * the node number so the iterator works. Might be worth reworking that bit.
+ * Every node along the insertion path is made writable on the way down,
+ * so nodes a snapshot can see are never touched. Rotations only ever
+ * involve nodes on that path.
+ *
+ * If a node can't be allocated, `*failed' is set and the subtree being
+ * looked at is handed back unchanged, so the tree above stays intact.
+ *
+ * DEVNOTE: The TLDList is passed along to increment the node number so the
+ * iterator works, and for its generation when copying nodes.
  * 
  * KUDOS: The AVL Tree article on geeksforgeeks.org for the core logic. No
  * particular author was specified that I could find.
  */
-TLDNode *tld_insert_helper(TLDList *tld, TLDNode *scrutiny, char *domain){
+TLDNode *tld_insert_helper(TLDList *tld, TLDNode *scrutiny, char *domain,
+                           int *failed){
 	// Standard BST insertion
 	if (scrutiny == 0){
-		tld->nodes++;
-		return tldnode_create(domain);
+		TLDNode *newnode = tldnode_create(domain, tld->gen);
+		if (newnode == 0)
+			*failed = 1;
+		else
+			tld->nodes++;
+		return newnode;
+	}
+
+	TLDNode *writable = tldnode_writable(tld, scrutiny);
+	if (writable == 0){
+		*failed = 1;
+		return scrutiny;
 	}
+	scrutiny = writable;
 	
 	if (strcmp(domain, scrutiny->domain) < 0)
-		scrutiny->left = tld_insert_helper(tld, scrutiny->left, domain);
+		scrutiny->left = tld_insert_helper(tld, scrutiny->left, domain,
+		                                   failed);
 	else if (strcmp(domain, scrutiny->domain) > 0)
-		scrutiny->right = tld_insert_helper(tld, scrutiny->right, domain);
+		scrutiny->right = tld_insert_helper(tld, scrutiny->right, domain,
+		                                    failed);
 	else {
 		scrutiny->frequency++;
 		return scrutiny;
@@ -135,7 +243,7 @@ TLDNode *tld_insert_helper(TLDList *tld, TLDNode *scrutiny, char *domain){
 	scrutiny->height = 1 + max_height(scrutiny->left, scrutiny->right);
 
 	// Check balance of node
-	int balance = scrutiny->left->height - scrutiny->right->height;
+	int balance = node_height(scrutiny->left) - node_height(scrutiny->right);
 
 	// Four-way case, depending on balance and where the new node belongs
 	if ((balance > 1) && (strcmp(domain, scrutiny->left->domain) < 0))
@@ -158,6 +266,17 @@ TLDNode *tld_insert_helper(TLDList *tld, TLDNode *scrutiny, char *domain){
 	return scrutiny;
 }
 
+// Helper function to tear down a tree, domains included
+void tld_destroy_helper(TLDNode *node){
+	if (node == 0)
+		return;
+
+	tld_destroy_helper(node->left);
+	tld_destroy_helper(node->right);
+	free(node->domain);
+	free(node);
+}
+
 // Helper function to build iterator - inorder traversal
 void iter_builder(int *i, TLDNode **target, TLDNode *current){
 	// Return on a null node
@@ -188,6 +307,13 @@ TLDList *tldlist_create(Date *begin, Date *end){
 	newlist->begin = date_duplicate(begin);
 	newlist->end = date_duplicate(end);
 
+	pthread_mutex_init(&newlist->lock, 0);
+	newlist->gen = 1;
+	newlist->readers = 0;
+	newlist->last_reader = 0;
+	newlist->retired = 0;
+	newlist->last_retired = 0;
+
 	return newlist;
 }
 
@@ -195,19 +321,18 @@ TLDList *tldlist_create(Date *begin, Date *end){
  * tldlist_destroy destroys the list structure in `tld'
  *
  * all heap allocated storage associated with the list is returned to the heap
+ *
+ * Any iterators over the list must be destroyed first.
  */
 void tldlist_destroy(TLDList *tld){
 	free(tld->begin);
 	free(tld->end);
 
-	TLDIterator *iter = tldlist_iter_create(tld);
-	TLDNode *garbage = tldlist_iter_next(iter);
-	while(garbage != 0){
-		free(garbage);   // I mean, *I* don't want it
-		garbage = tldlist_iter_next(iter);
-	}
+	// No snapshots left, so every retired node goes
+	tld_reclaim(tld);
+	tld_destroy_helper(tld->root);   // I mean, *I* don't want it
 
-	free(iter);
+	pthread_mutex_destroy(&tld->lock);
 	free(tld);
 	tld = 0;
 }
@@ -215,23 +340,31 @@ void tldlist_destroy(TLDList *tld){
 /*
  * tldlist_add adds the TLD contained in `hostname' to the tldlist if
  * `d' falls in the begin and end dates associated with the list;
- * returns 1 if the entry was counted, 0 if not
+ * returns 1 if the entry was counted, 0 if not (including when memory
+ * for it couldn't be allocated)
  */
 int tldlist_add(TLDList *tld, char *hostname, Date *d){
+	int failed = 0;
+
 	// Return 0 if the date is out of range
 	if ( (date_compare(tld->begin, d) < 0)
 	     | (date_compare(d, tld->end) < 0) 
 	   )
 		return 0;
 
+	pthread_mutex_lock(&tld->lock);
+
 	// Start at the root node - and change it, if necessary
-	tld->root = tld_insert_helper(tld, tld->root, hostname);
+	tld->root = tld_insert_helper(tld, tld->root, hostname, &failed);
 
 	// Increment the total number of successfully added TLDs
-	tld->total++;
+	if (!failed)
+		tld->total++;
+
+	pthread_mutex_unlock(&tld->lock);
 
 	// Return
-	return 1;
+	return !failed;
 }
 
 /*
@@ -239,12 +372,19 @@ int tldlist_add(TLDList *tld, char *hostname, Date *d){
  * the creation of the TLDList
  */
 long tldlist_count(TLDList *tld){
-	return tld->total;
+	pthread_mutex_lock(&tld->lock);
+	long total = tld->total;
+	pthread_mutex_unlock(&tld->lock);
+
+	return total;
 }
 
 /*
  * tldlist_iter_create creates an iterator over the TLDList; returns a pointer
  * to the iterator if successful, NULL if not
+ *
+ * The iterator walks a snapshot of the list taken at creation time, so
+ * tldlist_add may keep running from other threads while it's in use.
  */
 TLDIterator *tldlist_iter_create(TLDList *tld){
 	TLDIterator *newiter = (TLDIterator *) malloc(sizeof(TLDIterator));
@@ -252,16 +392,30 @@ TLDIterator *tldlist_iter_create(TLDList *tld){
 	if (newiter == 0)
 		return 0;
 
-	newiter->inorder = (TLDNode **) malloc(sizeof(TLDNode *) * tld->nodes);
+	// Capture the tree and close its generation so it stays frozen
+	pthread_mutex_lock(&tld->lock);
+	TLDNode *root = tld->root;
+	newiter->max = tld->nodes;
+	newiter->total = tld->total;
+	newiter->gen = tld->gen++;
+	newiter->owner = tld;
+	newiter->next = 0;
+	if (tld->last_reader == 0)
+		tld->readers = newiter;
+	else
+		tld->last_reader->next = newiter;
+	tld->last_reader = newiter;
+	pthread_mutex_unlock(&tld->lock);
+
+	newiter->inorder = (TLDNode **) malloc(sizeof(TLDNode *) * newiter->max);
 
 	// Fill the iterator
 	int i = 0;
 	int *p = &i;
-	iter_builder(p, newiter->inorder, tld->root);
+	iter_builder(p, newiter->inorder, root);
 	
 	// Fill remaining fields
 	newiter->index = 0;
-	newiter->max = tld->nodes;	
 
 	// Return
 	return newiter;
@@ -284,11 +438,37 @@ TLDNode *tldlist_iter_next(TLDIterator *iter){
  * tldlist_iter_destroy destroys the iterator specified by `iter'
  */
 void tldlist_iter_destroy(TLDIterator *iter){
+	TLDList *tld = iter->owner;
+
+	// Drop out of the live snapshots and free what that releases
+	pthread_mutex_lock(&tld->lock);
+	TLDIterator *prev = 0, *cur = tld->readers;
+	while (cur != iter){
+		prev = cur;
+		cur = cur->next;
+	}
+	if (prev == 0)
+		tld->readers = iter->next;
+	else
+		prev->next = iter->next;
+	if (tld->last_reader == iter)
+		tld->last_reader = prev;
+	tld_reclaim(tld);
+	pthread_mutex_unlock(&tld->lock);
+
 	free(iter->inorder);
 	free(iter);
 	iter = 0;
 }
 
+/*
+ * tldlist_iter_total returns the number of successful tldlist_add() calls
+ * as of the snapshot the iterator is walking
+ */
+long tldlist_iter_total(TLDIterator *iter){
+	return iter->total;
+}
+
 /*
  * tldnode_tldname returns the tld associated with the TLDNode
  */
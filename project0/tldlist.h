@@ -22,7 +22,8 @@ TLDList *tldlist_create(Date *begin, Date *end);
 /*
  * tldlist_destroy destroys the list structure in `tld'
  *
- * all heap allocated storage associated with the list is returned to the heap
+ * all heap allocated storage associated with the list is returned to the heap;
+ * any iterators over the list must have been destroyed first
  */
 void tldlist_destroy(TLDList *tld);
 
@@ -42,6 +43,9 @@ long tldlist_count(TLDList *tld);
 /*
  * tldlist_iter_create creates an iterator over the TLDList; returns a pointer
  * to the iterator if successful, NULL if not
+ *
+ * the iterator walks a consistent snapshot of the counts taken when it was
+ * created; tldlist_add may be called concurrently and is never held up by it
  */
 TLDIterator *tldlist_iter_create(TLDList *tld);
 
@@ -56,6 +60,12 @@ TLDNode *tldlist_iter_next(TLDIterator *iter);
  */
 void tldlist_iter_destroy(TLDIterator *iter);
 
+/*
+ * tldlist_iter_total returns the number of successful tldlist_add() calls
+ * as of the snapshot that `iter' is walking
+ */
+long tldlist_iter_total(TLDIterator *iter);
+
 /*
  * tldnode_tldname returns the tld associated with the TLDNode
  */
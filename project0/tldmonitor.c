@@ -3,7 +3,8 @@
 #include <stdio.h>
 #include <string.h>
 
-#define USAGE "usage: %s begin_datestamp end_datestamp [file] ...\n"
+#define USAGE "usage: %s [-f tld|clf] begin_datestamp end_datestamp [file] ...\n"
+#define CLF_BUFSIZE (64 * 1024)
 
 static void process(FILE *fd, TLDList *tld) {
     char bf[1024], sbf[1024];
@@ -30,6 +31,117 @@ static void process(FILE *fd, TLDList *tld) {
     }
 }
 
+/*
+ * month_number maps a three letter "Jan".."Dec" abbreviation onto 1..12,
+ * returning 0 if it isn't one
+ */
+static int month_number(const char *m) {
+    switch ((m[0] << 16) | (m[1] << 8) | m[2]) {
+    case ('J' << 16) | ('a' << 8) | 'n': return 1;
+    case ('F' << 16) | ('e' << 8) | 'b': return 2;
+    case ('M' << 16) | ('a' << 8) | 'r': return 3;
+    case ('A' << 16) | ('p' << 8) | 'r': return 4;
+    case ('M' << 16) | ('a' << 8) | 'y': return 5;
+    case ('J' << 16) | ('u' << 8) | 'n': return 6;
+    case ('J' << 16) | ('u' << 8) | 'l': return 7;
+    case ('A' << 16) | ('u' << 8) | 'g': return 8;
+    case ('S' << 16) | ('e' << 8) | 'p': return 9;
+    case ('O' << 16) | ('c' << 8) | 't': return 10;
+    case ('N' << 16) | ('o' << 8) | 'v': return 11;
+    case ('D' << 16) | ('e' << 8) | 'c': return 12;
+    }
+    return 0;
+}
+
+/*
+ * clf_line handles one Apache/NCSA common or combined log line, e.g.
+ *   host ident user [10/Oct/2000:13:55:36 -0700] "GET / HTTP/1.0" 200 ...
+ * the host is terminated in place and handed straight to tldlist_add;
+ * `last'/`lastd' cache the Date of the previous line, since access logs
+ * are in time order and consecutive lines nearly always share a day
+ */
+static int clf_line(char *line, char *end, TLDList *tld, char *last, Date **lastd) {
+    char *host_end, *stamp;
+    int day, month, year;
+
+    host_end = memchr(line, ' ', end - line);
+    if (host_end == NULL || host_end == line)
+        return 0;
+    stamp = memchr(host_end, '[', end - host_end);
+    if (stamp == NULL || end - ++stamp < 11 || stamp[2] != '/' || stamp[6] != '/')
+        return 0;
+    if (*lastd == NULL || memcmp(stamp, last, 11) != 0) {
+        day = (stamp[0] - '0') * 10 + (stamp[1] - '0');
+        month = month_number(stamp + 3);
+        year = (stamp[7] - '0') * 1000 + (stamp[8] - '0') * 100
+             + (stamp[9] - '0') * 10 + (stamp[10] - '0');
+        if (*lastd != NULL)
+            date_destroy(*lastd);
+        *lastd = date_create_dmy(day, month, year);
+        if (*lastd == NULL)
+            return 0;
+        memcpy(last, stamp, 11);
+    }
+    *host_end = '\0';
+    (void) tldlist_add(tld, line, *lastd);
+    return 1;
+}
+
+/*
+ * process_clf reads access logs in large blocks and slices lines out of
+ * them with memchr, which libc implements with wide vector compares;
+ * nothing is copied except the tail of a line that straddles two blocks
+ */
+static void process_clf(FILE *fd, TLDList *tld) {
+    char *bf = malloc(CLF_BUFSIZE + 1);
+    char last[11];
+    Date *lastd = NULL;
+    size_t have = 0, n;
+
+    if (bf == NULL) {
+        fprintf(stderr, "Unable to allocate input buffer\n");
+        return;
+    }
+    for (;;) {
+        char *p = bf, *q, *limit;
+
+        n = fread(bf + have, 1, CLF_BUFSIZE - have, fd);
+        have += n;
+        limit = bf + have;
+        if (n == 0 && have != 0)
+            *limit++ = '\n';		/* final line without newline */
+        while ((q = memchr(p, '\n', limit - p)) != NULL) {
+            if (q > p && !clf_line(p, q, tld, last, &lastd)) {
+                *q = '\0';
+                fprintf(stderr, "Illegal input line: %s\n", p);
+            }
+            p = q + 1;
+        }
+        if (n == 0)
+            break;
+        have = limit - p;
+        if (have == CLF_BUFSIZE) {
+            fprintf(stderr, "Input line longer than %d bytes\n", CLF_BUFSIZE);
+            break;
+        }
+        memmove(bf, p, have);
+    }
+    if (lastd != NULL)
+        date_destroy(lastd);
+    free(bf);
+}
+
+/*
+ * the input formats that can be selected with -f; the first is the default
+ */
+static struct {
+    const char *name;
+    void (*process)(FILE *, TLDList *);
+} formats[] = {
+    { "tld", process },
+    { "clf", process_clf },
+};
+
 int main(int argc, char *argv[]) {
     Date *begin = NULL, *end = NULL;
     int i;
@@ -38,9 +150,26 @@ int main(int argc, char *argv[]) {
     TLDIterator *it = NULL;
     TLDNode *n;
     double total;
+    void (*input)(FILE *, TLDList *) = formats[0].process;
+    char *prog = argv[0];
+
+    if (argc > 2 && strcmp(argv[1], "-f") == 0) {
+        size_t f;
 
+        for (f = 0; f < sizeof formats / sizeof formats[0]; f++)
+            if (strcmp(argv[2], formats[f].name) == 0)
+                break;
+        if (f == sizeof formats / sizeof formats[0]) {
+            fprintf(stderr, "Unknown input format: %s\n", argv[2]);
+            fprintf(stderr, USAGE, prog);
+            return -1;
+        }
+        input = formats[f].process;
+        argc -= 2;
+        argv += 2;
+    }
     if (argc < 3) {
-        fprintf(stderr, USAGE, argv[0]);
+        fprintf(stderr, USAGE, prog);
         return -1;
     }
     begin = date_create(argv[1]);
@@ -63,7 +192,7 @@ int main(int argc, char *argv[]) {
         goto error;
     }
     if (argc == 3)
-        process(stdin, tld);
+        input(stdin, tld);
     else {
         for (i = 3; i < argc; i++) {
             if (strcmp(argv[i], "-") == 0)
@@ -74,17 +203,17 @@ int main(int argc, char *argv[]) {
                 fprintf(stderr, "Unable to open %s\n", argv[i]);
                 continue;
             }
-            process(fd, tld);
+            input(fd, tld);
             if (fd != stdin)
                 fclose(fd);
         }
     }
-    total = (double)tldlist_count(tld);
     it = tldlist_iter_create(tld);
     if (it == NULL) {
         fprintf(stderr, "Unable to create iterator\n");
         goto error;
     }
+    total = (double)tldlist_iter_total(it);
     while ((n = tldlist_iter_next(it))) {
         printf("%6.2f %s\n", 100.0 * (double)tldnode_count(n)/total, tldnode_tldname(n));
     }
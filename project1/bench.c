@@ -0,0 +1,286 @@
+/*
+ * Assignment: CIS 415 Project 1
+ *
+ * bench - runs a benchmark workload (see benchgen) under each USPS
+ * variant in turn and reports how well it was scheduled.
+ *
+ * Every job is a benchkernel, which publishes its progress into a shared
+ * memory slot the harness maps, so nothing depends on the scheduler's own
+ * output. For each scheduler it reports:
+ *
+ *   turnaround    submission to the job's last unit of work
+ *   response      submission to the job's first moment on a CPU
+ *   fairness      Jain's index over each job's service (CPU time plus the
+ *                 time it asked to sleep) per unit of turnaround; 1.0 is
+ *                 perfectly even, 1/n is one job getting everything
+ *   throughput    jobs finished per second of makespan
+ *   overhead      CPU the scheduler burned itself: its rusage, which
+ *                 includes the jobs it reaped, less the jobs' own CPU time
+ *
+ * A scheduler spec is the program, optionally followed by extra arguments
+ * separated by colons, e.g. uspsv4:-policy=mlfq. Each one runs in its own
+ * process group, which is killed after -timeout seconds or once the
+ * scheduler exits, so a hung variant can't take the others with it.
+ *
+ * usage: bench [-quantum=msec] [-timeout=sec] [-schedulers=spec,spec,...]
+ *              workload_file
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "p1fxns.h"
+#include "usps.h"
+#include "bench.h"
+
+#define USAGE "usage: bench [-quantum=msec] [-timeout=sec] " \
+              "[-schedulers=spec,spec,...] workload_file\n"
+#define SCHEDULERS "uspsv1,uspsv2,uspsv3,uspsv4"
+#define MAX_ARGS 16
+
+static char *workload_file;
+static char *quantum = "20";
+static int timeout_sec = 30;
+static BenchRegion *region;
+static int n_slots;
+
+static int run(char *spec);
+static void report(char *spec, long long start, long long wall,
+                   long long sched_cpu, int timed_out);
+
+// Main program
+int main(int argc, char *argv[]){
+    char *schedulers = SCHEDULERS, *spec, name[64], num[16];
+    P1Reader *reader;
+    P1Workload *workload;
+    int fd = -1, i, j;
+
+    // Check for arguments
+    for (i = 1; i < argc; i++){
+        if (p1strneq(argv[i], "-quantum=", 9)){
+            quantum = argv[i] + 9;
+        } else if (p1strneq(argv[i], "-timeout=", 9)){
+            timeout_sec = p1atoi(argv[i] + 9);
+        } else if (p1strneq(argv[i], "-schedulers=", 12)){
+            schedulers = argv[i] + 12;
+        } else if (argv[i][0] == '-'){
+            p1putstr(2, USAGE);
+            exit(EXIT_FAILURE);
+        } else {
+            workload_file = argv[i];
+        }
+    }
+    if (workload_file == NULL || timeout_sec < 1 || usps_parse_msec(quantum) < 0){
+        p1putstr(2, USAGE);
+        exit(EXIT_FAILURE);
+    }
+
+    // One slot per job, as numbered by the kernels' -slot flags
+    if ((fd = open(workload_file, O_RDONLY)) < 0){
+        p1perror(2, "Could not open specified file");
+        exit(EXIT_FAILURE);
+    }
+    if ((reader = p1reader_create(fd)) == NULL
+        || (workload = p1workload_read(reader, -1)) == NULL){
+        p1perror(2, "Could not read workload");
+        exit(EXIT_FAILURE);
+    }
+    p1reader_destroy(reader);
+    close(fd);
+    for (i = 0; i < workload->count; i++){
+        char **word;
+
+        for (word = workload->argv[i]; *word != NULL; word++){
+            if (p1strneq(*word, "-slot", 6) && word[1] != NULL
+                && (j = p1atoi(word[1])) >= n_slots)
+                n_slots = j + 1;
+        }
+    }
+    p1workload_destroy(workload);
+    if (n_slots == 0){
+        errno = EINVAL;
+        p1perror(2, "No benchkernel -slot jobs in workload");
+        exit(EXIT_FAILURE);
+    }
+
+    // The shared memory the kernels publish into
+    p1strcpy(name, "/usps-bench-");
+    p1itoa((int) getpid(), num);
+    p1strcat(name, num);
+    if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0
+        || ftruncate(fd, BENCH_REGION_SIZE(n_slots)) < 0){
+        p1perror(2, "Could not create shared memory");
+        exit(EXIT_FAILURE);
+    }
+    region = mmap(NULL, BENCH_REGION_SIZE(n_slots), PROT_READ | PROT_WRITE,
+                  MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED){
+        p1perror(2, "Could not map shared memory");
+        shm_unlink(name);
+        exit(EXIT_FAILURE);
+    }
+    setenv(BENCH_SHM_ENV, name, 1);
+    setenv("USPS_QUANTUM_MSEC", quantum, 1);
+
+    dprintf(1, "workload %s: %d jobs, quantum %sms\n",
+            workload_file, n_slots, quantum);
+    for (spec = schedulers; *spec != '\0'; ){
+        char one[256];
+
+        for (i = 0; spec[i] != '\0' && spec[i] != ',' && i < 255; i++)
+            one[i] = spec[i];
+        one[i] = '\0';
+        spec += i + (spec[i] == ',');
+        if (i > 0)
+            run(one);
+    }
+
+    munmap(region, BENCH_REGION_SIZE(n_slots));
+    shm_unlink(name);
+    exit(EXIT_SUCCESS);
+}
+
+// Runs the workload under one scheduler; returns -1 if it couldn't start
+static int run(char *spec){
+    char *args[MAX_ARGS + 4], path[256], buf[256], qarg[64];
+    long long start, wall, deadline;
+    struct rusage ru;
+    struct timespec nap = {0, 1000000};
+    int i, n = 0, status, timed_out = 0;
+    char sep;
+    pid_t pid;
+
+    // The program, any :-separated extra arguments, then the workload;
+    // uspsv3 and uspsv4 take the quantum as a flag, the others only
+    // read it from the environment
+    p1strcpy(buf, spec);
+    for (i = 0; buf[i] != '\0' && buf[i] != ':'; i++)
+        ;
+    sep = buf[i];
+    buf[i] = '\0';
+    p1strcpy(path, (p1strchr(buf, '/') >= 0) ? "" : "./");
+    p1strcat(path, buf);
+    args[n++] = path;
+    if (p1strneq(buf, "uspsv3", 7) || p1strneq(buf, "uspsv4", 7)){
+        p1strcpy(qarg, "-quantum=");
+        p1strcat(qarg, quantum);
+        args[n++] = qarg;
+    }
+    while (sep == ':' && n < MAX_ARGS){
+        args[n++] = buf + ++i;
+        while (buf[i] != '\0' && buf[i] != ':')
+            i++;
+        sep = buf[i];
+        buf[i] = '\0';
+    }
+    args[n++] = workload_file;
+    args[n] = NULL;
+
+    for (i = 0; i < n_slots; i++){
+        region->slot[i].pid = 0;
+        region->slot[i].done = 0;
+        region->slot[i].units = region->slot[i].progress = 0;
+        region->slot[i].first_ns = region->slot[i].last_ns = 0;
+        region->slot[i].cpu_ns = region->slot[i].sleep_ns = 0;
+    }
+    region->n_slots = n_slots;
+    __atomic_store_n(&region->magic, BENCH_MAGIC, __ATOMIC_RELEASE);
+
+    start = usps_now_ns();
+    if ((pid = fork()) == 0){
+        // !!! CHILD PROCESS CODE !!!
+        int null = open("/dev/null", O_RDWR);
+
+        setpgid(0, 0);
+        if (null >= 0){
+            dup2(null, 1);
+            dup2(null, 0);
+            close(null);
+        }
+        execv(path, args);
+        p1perror(2, "Could not execute scheduler");
+        _exit(127);
+    } else if (pid < 0){
+        p1perror(2, "Could not fork");
+        return -1;
+    }
+    setpgid(pid, pid);
+
+    // Poll so a hung scheduler can be cut off at the deadline
+    deadline = start + timeout_sec * 1000000000LL;
+    while (wait4(pid, &status, WNOHANG, &ru) == 0){
+        if (usps_now_ns() >= deadline){
+            kill(-pid, SIGKILL);
+            wait4(pid, &status, 0, &ru);
+            timed_out = 1;
+            break;
+        }
+        nanosleep(&nap, NULL);
+    }
+    wall = usps_now_ns() - start;
+
+    // Nothing the scheduler left behind survives into the next run
+    kill(-pid, SIGKILL);
+
+    report(spec, start, wall,
+           (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000LL
+           + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000LL,
+           timed_out);
+    return 0;
+}
+
+// Turnaround, response, fairness, throughput and overhead for one run
+static void report(char *spec, long long start, long long wall,
+                   long long sched_cpu, int timed_out){
+    UspsStat turnaround, response;
+    double sum = 0.0, sumsq = 0.0;
+    long long makespan = 0, jobs_cpu = 0;
+    int i, done = 0;
+
+    usps_stat_init(&turnaround);
+    usps_stat_init(&response);
+    for (i = 0; i < n_slots; i++){
+        BenchSlot *bs = &region->slot[i];
+
+        if (bs->first_ns != 0)
+            usps_stat_add(&response, bs->first_ns - start);
+        if (!__atomic_load_n(&bs->done, __ATOMIC_ACQUIRE))
+            continue;
+        done++;
+        usps_stat_add(&turnaround, bs->last_ns - start);
+        if (bs->last_ns - start > makespan)
+            makespan = bs->last_ns - start;
+        jobs_cpu += bs->cpu_ns;
+        if (bs->last_ns > start){
+            double x = (double) (bs->cpu_ns + bs->sleep_ns)
+                       / (bs->last_ns - start);
+
+            sum += x;
+            sumsq += x * x;
+        }
+    }
+
+    dprintf(1, "\n%s: %d/%d jobs finished in %.1fms%s\n", spec, done,
+            n_slots, wall / 1e6, timed_out ? " (timed out)" : "");
+    usps_stat_print(1, "turnaround", &turnaround);
+    usps_stat_print(1, "response", &response);
+    if (done > 0 && sumsq > 0.0)
+        dprintf(1, "%-18s %.3f\n", "fairness (Jain)",
+                sum * sum / (done * sumsq));
+    if (makespan > 0)
+        dprintf(1, "%-18s %.2f jobs/sec\n", "throughput",
+                done * 1e9 / makespan);
+    sched_cpu -= jobs_cpu;
+    dprintf(1, "%-18s %.1fms cpu (%.2f%% of wall)\n", "overhead",
+            (sched_cpu > 0 ? sched_cpu : 0) / 1e6,
+            wall > 0 ? 100.0 * (sched_cpu > 0 ? sched_cpu : 0) / wall : 0.0);
+}
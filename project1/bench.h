@@ -0,0 +1,48 @@
+/*
+ *	shared memory layout for the scheduler benchmarks
+ *
+ *	the harness (bench) creates a POSIX shared memory object holding one
+ *	BenchSlot per job and names it in USPS_BENCH_SHM; each kernel
+ *	(benchkernel) run under a scheduler maps it and publishes its
+ *	progress in the slot given by its -slot flag.  every time is
+ *	CLOCK_MONOTONIC in nanoseconds, so it compares across processes
+ */
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#define BENCH_SHM_ENV "USPS_BENCH_SHM"
+#define BENCH_MAGIC   0x55505342    /* "UPSB"; "BSPU" on disk */
+
+/*
+ *	kinds of kernel, and what one unit of work is for each
+ */
+#define KIND_CPU     0      /* integer arithmetic in registers */
+#define KIND_MEM     1      /* one pass copying a buffer much larger than cache */
+#define KIND_SYSCALL 2      /* a batch of cheap system calls */
+#define KIND_SLEEP   3      /* a short sleep, then a little arithmetic */
+#define KINDS        4
+
+/*
+ *	one kernel's progress; written only by the kernel, read by the harness
+ */
+typedef struct benchslot {
+    volatile int pid;
+    volatile int done;              /* set last, once everything is final */
+    volatile long long units;       /* units of work asked for */
+    volatile long long progress;    /* units finished so far */
+    volatile long long first_ns;    /* when it first got the CPU */
+    volatile long long last_ns;     /* when it last finished a unit */
+    volatile long long cpu_ns;      /* its own CPU time, at exit */
+    volatile long long sleep_ns;    /* time it asked to sleep, at exit */
+} BenchSlot;
+
+typedef struct benchregion {
+    int magic;
+    int n_slots;
+    BenchSlot slot[];
+} BenchRegion;
+
+#define BENCH_REGION_SIZE(n) (sizeof(BenchRegion) + (n) * sizeof(BenchSlot))
+
+#endif	/* _BENCH_H_ */
@@ -0,0 +1,116 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "bench.h"
+
+/*
+ * writes a benchmark workload file on stdout: -jobs lines, each running
+ * benchkernel on a kind of work picked by the -mix weights, sized to take
+ * between half and one and a half times -ms milliseconds on its own
+ *
+ * usage: benchgen [-jobs N] [-ms msec] [-mix cpu=W,mem=W,syscall=W,sleep=W]
+ *                 [-seed S] [-kernel PATH]
+ *
+ * each kind's unit of work is timed once by running the kernel with
+ * -calibrate, so job lengths hold on whatever machine generates them
+ */
+
+static char *kinds[KINDS] = { "cpu", "mem", "syscall", "sleep" };
+static int calibration_units[KINDS] = { 20, 4, 20, 20 };
+
+// Runs the kernel with -calibrate; returns ns per unit of kind, -1 on error
+static long long calibrate(char *kernel, int kind) {
+    char cmd[1024];
+    long long ns = -1;
+    FILE *fp;
+
+    snprintf(cmd, sizeof(cmd), "%s -kind %s -units %d -calibrate",
+             kernel, kinds[kind], calibration_units[kind]);
+    if ((fp = popen(cmd, "r")) == NULL)
+        return -1;
+    if (fscanf(fp, "%lld", &ns) != 1)
+        ns = -1;
+    pclose(fp);
+    return ns;
+}
+
+int main(int argc, char **argv) {
+    int jobs = 20, ms = 200, weights[KINDS] = { 1, 1, 1, 1 };
+    int i, k, total = 0;
+    unsigned int seed = 415;
+    char *kernel = "./benchkernel";
+    long long unit_ns[KINDS];
+
+/*
+ * process command line arguments
+ */
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-jobs") == 0 && i + 1 < argc) {
+            jobs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-ms") == 0 && i + 1 < argc) {
+            ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc) {
+            seed = (unsigned int) atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-kernel") == 0 && i + 1 < argc) {
+            kernel = argv[++i];
+        } else if (strcmp(argv[i], "-mix") == 0 && i + 1 < argc) {
+            char *p = argv[++i];
+
+            for (k = 0; k < KINDS; k++)
+                weights[k] = 0;
+            while (*p != '\0') {
+                for (k = 0; k < KINDS; k++) {
+                    int len = strlen(kinds[k]);
+
+                    if (strncmp(p, kinds[k], len) == 0 && p[len] == '=')
+                        break;
+                }
+                if (k == KINDS) {
+                    fprintf(stderr, "Bad mix: `%s'\n", argv[i]);
+                    exit(1);
+                }
+                weights[k] = (int) strtol(p + strlen(kinds[k]) + 1, &p, 10);
+                if (*p == ',')
+                    p++;
+            }
+        } else {
+            fprintf(stderr, "Illegal flag: `%s'\n", argv[i]);
+            exit(1);
+        }
+    }
+    for (k = 0; k < KINDS; k++) {
+        if (weights[k] < 0)
+            weights[k] = 0;
+        total += weights[k];
+    }
+    if (jobs < 1 || ms < 1 || total == 0) {
+        fprintf(stderr, "usage: benchgen [-jobs N] [-ms msec] "
+                "[-mix cpu=W,mem=W,syscall=W,sleep=W] [-seed S] "
+                "[-kernel PATH]\n");
+        exit(1);
+    }
+
+    for (k = 0; k < KINDS; k++) {
+        if (weights[k] == 0)
+            continue;
+        if ((unit_ns[k] = calibrate(kernel, k)) <= 0) {
+            fprintf(stderr, "Could not calibrate `%s' with %s\n",
+                    kinds[k], kernel);
+            exit(1);
+        }
+    }
+
+    srand(seed);
+    for (i = 0; i < jobs; i++) {
+        long long job_ns, units;
+        int pick = rand() % total;
+
+        for (k = 0; pick >= weights[k]; k++)
+            pick -= weights[k];
+        job_ns = (ms / 2 + rand() % (ms + 1)) * 1000000LL;
+        units = job_ns / unit_ns[k];
+        printf("%s -kind %s -units %lld -slot %d\n",
+               kernel, kinds[k], units > 0 ? units : 1, i);
+    }
+    return 0;
+}
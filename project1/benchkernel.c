@@ -0,0 +1,168 @@
+#define _GNU_SOURCE     // For syscall
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "bench.h"
+
+/*
+ * a benchmark workload kernel: does -units units of one kind of work,
+ * publishing its progress into slot -slot of the harness's shared memory
+ * (named by USPS_BENCH_SHM) if there is one
+ *
+ * usage: benchkernel -kind cpu|mem|syscall|sleep [-units N] [-slot S]
+ *                    [-kb KB] [-sleep msec] [-calibrate] [-name NAME]
+ *
+ * -calibrate prints the nanoseconds one unit takes on this machine instead,
+ * which benchgen uses to size jobs in milliseconds
+ */
+
+#define CPU_ITERATIONS (1 << 20)
+#define SYSCALLS 1000
+
+static char *kinds[KINDS] = { "cpu", "mem", "syscall", "sleep" };
+static volatile unsigned long sink;
+
+static long long now_ns(int clock) {
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void spin(long iterations) {
+    unsigned long x = sink;
+    long i;
+
+    for (i = 0; i < iterations; i++)
+        x = x * 6364136223846793005UL + 1442695040888963407UL;
+    sink = x;
+}
+
+static BenchSlot *attach(int slot) {
+    char *name = getenv(BENCH_SHM_ENV);
+    BenchRegion *region;
+    int fd, n;
+
+    if (name == NULL || slot < 0)
+        return NULL;
+    if ((fd = shm_open(name, O_RDWR, 0)) < 0)
+        return NULL;
+    region = mmap(NULL, BENCH_REGION_SIZE(0), PROT_READ, MAP_SHARED, fd, 0);
+    if (region == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+    n = (region->magic == BENCH_MAGIC) ? region->n_slots : 0;
+    munmap(region, BENCH_REGION_SIZE(0));
+    if (slot >= n) {
+        close(fd);
+        return NULL;
+    }
+    region = mmap(NULL, BENCH_REGION_SIZE(n), PROT_READ | PROT_WRITE,
+                  MAP_SHARED, fd, 0);
+    close(fd);
+    return (region == MAP_FAILED) ? NULL : &region->slot[slot];
+}
+
+int main(int argc, char **argv) {
+    long long units = 10, i, start, slept = 0;
+    int kind = -1, slot = -1, calibrate = 0, kb = 16384, msec = 1, j;
+    char *src = NULL, *dst = NULL;
+    struct timespec nap;
+    BenchSlot *bs;
+
+/*
+ * process command line arguments
+ */
+    for (j = 1; j < argc; j++) {
+        if (strcmp(argv[j], "-kind") == 0 && j + 1 < argc) {
+            j++;
+            for (kind = KINDS - 1; kind >= 0; kind--)
+                if (strcmp(argv[j], kinds[kind]) == 0)
+                    break;
+        } else if (strcmp(argv[j], "-units") == 0 && j + 1 < argc) {
+            units = atoll(argv[++j]);
+        } else if (strcmp(argv[j], "-slot") == 0 && j + 1 < argc) {
+            slot = atoi(argv[++j]);
+        } else if (strcmp(argv[j], "-kb") == 0 && j + 1 < argc) {
+            kb = atoi(argv[++j]);
+        } else if (strcmp(argv[j], "-sleep") == 0 && j + 1 < argc) {
+            msec = atoi(argv[++j]);
+        } else if (strcmp(argv[j], "-calibrate") == 0) {
+            calibrate = 1;
+        } else if (strcmp(argv[j], "-name") == 0 && j + 1 < argc) {
+            j++;
+        } else {
+            fprintf(stderr, "Illegal flag: `%s'\n", argv[j]);
+            exit(1);
+        }
+    }
+    if (kind < 0 || units < 1 || kb < 1 || msec < 0) {
+        fprintf(stderr, "usage: benchkernel -kind cpu|mem|syscall|sleep "
+                "[-units N] [-slot S] [-kb KB] [-sleep msec] [-calibrate]\n");
+        exit(1);
+    }
+
+    start = now_ns(CLOCK_MONOTONIC);
+    bs = calibrate ? NULL : attach(slot);
+    if (bs != NULL) {
+        bs->pid = getpid();
+        bs->units = units;
+        bs->progress = 0;
+        bs->first_ns = bs->last_ns = start;
+    }
+    if (kind == KIND_MEM) {
+        src = malloc(kb * 1024L);
+        dst = malloc(kb * 1024L);
+        if (src == NULL || dst == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        memset(src, 1, kb * 1024L);
+        memset(dst, 0, kb * 1024L);
+        start = now_ns(CLOCK_MONOTONIC);
+    }
+    nap.tv_sec = msec / 1000;
+    nap.tv_nsec = (msec % 1000) * 1000000L;
+
+    for (i = 0; i < units; i++) {
+        switch (kind) {
+        case KIND_CPU:
+            spin(CPU_ITERATIONS);
+            break;
+        case KIND_MEM:
+            memcpy(dst, src, kb * 1024L);
+            sink += dst[i % (kb * 1024L)];
+            break;
+        case KIND_SYSCALL:
+            for (j = 0; j < SYSCALLS; j++)
+                sink += syscall(SYS_getppid);
+            break;
+        case KIND_SLEEP:
+            nanosleep(&nap, NULL);
+            slept += msec * 1000000LL;
+            spin(CPU_ITERATIONS / 64);
+            break;
+        }
+        if (bs != NULL) {
+            bs->last_ns = now_ns(CLOCK_MONOTONIC);
+            bs->progress = i + 1;
+        }
+    }
+
+    if (calibrate) {
+        printf("%lld\n", (now_ns(CLOCK_MONOTONIC) - start) / units);
+    } else if (bs != NULL) {
+        bs->cpu_ns = now_ns(CLOCK_PROCESS_CPUTIME_ID);
+        bs->sleep_ns = slept;
+        __atomic_store_n(&bs->done, 1, __ATOMIC_RELEASE);
+    }
+    free(src);
+    free(dst);
+    return 0;
+}
@@ -0,0 +1,70 @@
+/*
+ *	live metrics published by uspsv4 --metrics, read by uspstop
+ *
+ *	the scheduler is the only writer.  it keeps a POSIX shared memory
+ *	object named /usps-<pid> up to date with plain stores, no system
+ *	calls, bracketing each group of stores with a sequence count that
+ *	is odd while they're under way.  nothing else happens inside that
+ *	window, so it is always short; a reader copies the whole segment
+ *	and retries if the count was odd or moved while it copied
+ *
+ *	the segment is a UspsMetrics header, then n_slots UspsMetricsSlot,
+ *	then n_jobs UspsMetricsJob.  it grows as jobs are streamed in with
+ *	--listen; a reader that finds size larger than it has mapped should
+ *	map it again
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#define METRICS_MAGIC   0x55505354      /* "UPST"; "TSPU" on disk */
+#define METRICS_VERSION 1
+#define METRICS_PREFIX  "/usps-"
+
+/*
+ *	dispatch latency histogram: four buckets per power of two, so a
+ *	percentile read back from it is within about 12% of the truth
+ */
+#define HIST_BUCKETS 256
+
+typedef struct uspsmetricsjob {
+    int pid;
+    int state;                  /* JOB_ states from usps.h */
+    int slices;
+    int slot;
+    long long cpu_ns;           /* measured from /proc, when the policy does */
+    long long run_ns;           /* time spent holding a slot */
+    long long wait_ns;          /* time spent ready but not running */
+    char name[32];              /* its command, cut short */
+} UspsMetricsJob;
+
+typedef struct uspsmetricsslot {
+    int cpu;
+    int current;                /* job index, -1 if idle */
+    int waiting;                /* run queue length */
+    long switches;
+} UspsMetricsSlot;
+
+typedef struct uspsmetrics {
+    unsigned int magic;
+    unsigned int version;
+    volatile unsigned int seq;  /* odd while the scheduler is writing */
+    int finished;               /* set once every job has been reaped */
+    int size;                   /* of the whole segment, in bytes */
+    int n_slots;
+    int n_jobs;
+    int live;
+    char policy[16];
+    long long quantum_ns;
+    long long started_ns;       /* CLOCK_MONOTONIC when scheduling began */
+    long long updated_ns;       /* and when the segment was last written */
+    long switches;
+    long dispatch_hist[HIST_BUCKETS];
+} UspsMetrics;
+
+#define METRICS_SIZE(slots, jobs) (sizeof(UspsMetrics) \
+        + (slots) * sizeof(UspsMetricsSlot) + (jobs) * sizeof(UspsMetricsJob))
+#define METRICS_SLOTS(m) ((UspsMetricsSlot *) ((m) + 1))
+#define METRICS_JOBS(m)  ((UspsMetricsJob *) (METRICS_SLOTS(m) + (m)->n_slots))
+
+#endif	/* _METRICS_H_ */
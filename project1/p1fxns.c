@@ -7,7 +7,213 @@
 #include <stdlib.h>
 #include "p1fxns.h"
 #include <string.h>
+#include <stdint.h>
 #include <errno.h>
+#include <sys/uio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define READER_SIZE 8192
+#define WRITER_SIZE 4096
+
+struct p1reader {
+    int fd;
+    char *buf;
+    int size;       /* allocated size of buf, less room for an EOS */
+    int start;      /* first unconsumed byte */
+    int end;        /* one past the last byte read */
+    int eof;
+};
+
+struct p1writer {
+    int fd;
+    int len;
+    char buf[WRITER_SIZE];
+};
+
+/*
+ *	block-at-a-time string scanning
+ *
+ *	the scans look at a BLOCK of bytes per step: 16 with SSE2, otherwise
+ *	a machine word, using the exact form of the has-a-zero-byte trick.
+ *	each yields a Mask with a bit (or, for words, a byte) set per
+ *	matching byte.  blocks are loaded from aligned addresses, so a scan
+ *	never touches a page the string doesn't; bytes of the first block
+ *	that come before the string are masked off with skip()
+ */
+#define PAGE 4096
+
+/* reading past the EOS within a block looks like an overflow to ASan */
+#ifdef __SANITIZE_ADDRESS__
+#define SCAN __attribute__((no_sanitize_address))
+#else
+#define SCAN
+#endif
+
+#ifdef __SSE2__
+#define BLOCK 16
+typedef unsigned int Mask;
+
+SCAN static inline Mask find_byte(const char *p, char c) {
+    __m128i v = _mm_load_si128((const __m128i *)p);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+}
+
+static inline Mask skip(Mask m, int n) {
+    return m & (~0U << n);
+}
+
+static inline int first(Mask m) {
+    return __builtin_ctz(m);
+}
+
+SCAN static inline int block_eq(const char *a, const char *b) {
+    __m128i x = _mm_loadu_si128((const __m128i *)a);
+    __m128i y = _mm_loadu_si128((const __m128i *)b);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) == 0xffff;
+}
+#else
+#define BLOCK ((int)sizeof(unsigned long))
+#define ONES ((unsigned long)-1 / 0xff)
+#define LOWS (ONES * 0x7f)
+typedef unsigned long Mask;
+
+SCAN static inline Mask find_byte(const char *p, char c) {
+    unsigned long v;
+
+    memcpy(&v, p, sizeof v);
+    v ^= ONES * (unsigned char)c;
+    return ~(((v & LOWS) + LOWS) | v | LOWS);
+}
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+static inline Mask skip(Mask m, int n) {
+    return (n == 0) ? m : m & (~0UL >> (8 * n));
+}
+
+static inline int first(Mask m) {
+    return __builtin_clzl(m) / 8;
+}
+#else
+static inline Mask skip(Mask m, int n) {
+    return m & (~0UL << (8 * n));
+}
+
+static inline int first(Mask m) {
+    return __builtin_ctzl(m) / 8;
+}
+#endif
+
+SCAN static inline int block_eq(const char *a, const char *b) {
+    unsigned long x, y;
+
+    memcpy(&x, a, sizeof x);
+    memcpy(&y, b, sizeof y);
+    return x == y;
+}
+#endif
+
+/* an unaligned block read at p would run into the next page */
+#define NEAR_PAGE_END(p) (((uintptr_t)(p) & (PAGE - 1)) > PAGE - BLOCK)
+
+/*
+ *	character classes for the tokenizer; a word runs until a byte in
+ *	its stop set, blanks for a bare word or its quote for a quoted one
+ */
+#define C_END    1
+#define C_BLANK  2
+#define C_SQUOTE 4
+#define C_DQUOTE 8
+
+static const unsigned char cclass[256] = {
+    ['\0'] = C_END, [' '] = C_BLANK, ['\t'] = C_BLANK,
+    ['\''] = C_SQUOTE, ['"'] = C_DQUOTE,
+};
+
+#define CLASS(c) cclass[(unsigned char)(c)]
+
+/*
+ *	skip any opening quote at buf[*i] and return the word's stop set
+ */
+static int word_stop(char buf[], int *i) {
+    switch (CLASS(buf[*i])) {
+    case C_SQUOTE: (*i)++; return C_SQUOTE | C_END;
+    case C_DQUOTE: (*i)++; return C_DQUOTE | C_END;
+    default: return C_BLANK | C_END;
+    }
+}
+
+/*
+ *	p1workload_read - read lines from r and split each into words
+ *
+ *	the text of every line is copied once into the tail of the block
+ *	holding the argv arrays and tokenized there with p1tokenize
+ */
+P1Workload *p1workload_read(P1Reader *r, int limit) {
+    P1Workload *w;
+    char *text = NULL, *line, **words;
+    int *offsets = NULL;
+    int n = 0, lines = 0, nwords = 0, size = 0, used = 0, len, i;
+
+    while (n != limit && (line = p1reader_line(r, &len)) != NULL) {
+        if (n == lines) {
+            int *p = (int *)realloc(offsets, 2 * (lines + 8) * sizeof(int));
+
+            if (p == NULL)
+                goto fail;
+            offsets = p;
+            lines = 2 * (lines + 8);
+        }
+        if (used + len + 1 > size) {
+            char *p;
+
+            while (used + len + 1 > size)
+                size = 2 * size + READER_SIZE;
+            if ((p = (char *)realloc(text, size)) == NULL)
+                goto fail;
+            text = p;
+        }
+        memcpy(text + used, line, len + 1);
+        offsets[n++] = used;
+        used += len + 1;
+        nwords += p1tokenize(line, NULL) + 1;
+    }
+
+    w = (P1Workload *)malloc(sizeof(P1Workload) + n * sizeof(char **)
+                             + nwords * sizeof(char *) + used);
+    if (w == NULL)
+        goto fail;
+    w->count = n;
+    w->argv = (char ***)(w + 1);
+    words = (char **)(w->argv + n);
+    line = (char *)(words + nwords);
+    if (used > 0)
+        memcpy(line, text, used);
+    for (i = 0; i < n; i++) {
+        w->argv[i] = words;
+        words += p1tokenize(line + offsets[i], words) + 1;
+    }
+    free(text);
+    free(offsets);
+    return w;
+
+fail:
+    free(text);
+    free(offsets);
+    return NULL;
+}
+
+/*
+ *	p1workload_destroy - return the workload's storage to the heap
+ */
+void p1workload_destroy(P1Workload *w) {
+    free(w);
+}
+
+static void writer_init(struct p1writer *w, int fd);
 
 /*
  *	p1getline - return EOS-terminated character array from fd
@@ -15,11 +221,26 @@
  *	returns number of characters in buf as result, 0 if end of file
  */
 int p1getline(int fd, char buf[], int size) {
-    int i;
+    int i, n;
     char c;
     int max = size - 1; /* must leave room for EOS */
 
-    i = 0;
+    /*
+     * on anything seekable, read a block and give back what follows the
+     * line, so fd ends up exactly where a byte-at-a-time read would leave it
+     */
+    if (max > 0 && lseek(fd, 0, SEEK_CUR) >= 0) {
+        char *nl;
+
+        if ((n = read(fd, buf, max)) < 0)
+            n = 0;
+        nl = memchr(buf, '\n', n);
+        i = (nl == NULL) ? n : (nl - buf) + 1;
+        if (i < n)
+            lseek(fd, i - n, SEEK_CUR);
+        buf[i] = '\0';
+        return i;
+    }
     for (i = 0; i < max; i++) {
         if (read(fd, &c, 1) == 0)
             break;
@@ -38,13 +259,21 @@ int p1getline(int fd, char buf[], int size) {
  *
  *	return -1 if not found
  */
-int p1strchr(char buf[], char c) {
-    int i;
+SCAN int p1strchr(char buf[], char c) {
+    int off = (uintptr_t)buf % BLOCK;
+    const char *p = buf - off;
+    Mask end = skip(find_byte(p, '\0'), off);
+    Mask hit = skip(find_byte(p, c), off);
 
-    for (i = 0; buf[i] != '\0'; i++)
-        if (buf[i] == c)
-            return i;
-    return -1;
+    while ((end | hit) == 0) {
+        p += BLOCK;
+        end = find_byte(p, '\0');
+        hit = find_byte(p, c);
+    }
+    /* a match at or past the EOS doesn't count, so nor does c == '\0' */
+    if (hit == 0 || (end != 0 && first(end) <= first(hit)))
+        return -1;
+    return p - buf + first(hit);
 }
 
 /*
@@ -54,50 +283,77 @@ int p1strchr(char buf[], char c) {
  *
  *	N.B. assumes that word[] is large enough to hold the next word
  */
-static char *singlequote = "'";
-static char *doublequote = "\"";
-static char *whitespace = " \t";
-
 int p1getword(char buf[], int i, char word[]) {
-    char *tc, *p;
+    char *p;
+    int stop;
 
     /* skip leading white space */
-    while(p1strchr(whitespace, buf[i]) != -1)
+    while (CLASS(buf[i]) & C_BLANK)
         i++;
     /* buf[i] is now '\0' or a non-blank character */
     if (buf[i] == '\0')
         return -1;
     p = word;
-    switch(buf[i]) {
-    case '\'': tc = singlequote; i++; break;
-    case '"': tc = doublequote; i++; break;
-    default: tc = whitespace; break;
-    }
-    while (buf[i] != '\0') {
-        if (p1strchr(tc, buf[i]) != -1)
-            break;
-        *p++ = buf[i];
+    stop = word_stop(buf, &i);
+    while (!(CLASS(buf[i]) & stop))
+        *p++ = buf[i++];
+    /* either at end of string or have found one of the terminators;
+     * a closing quote is skipped, a blank left for the next search */
+    if (buf[i] != '\0' && !(stop & C_BLANK))
         i++;
-    }
-    /* either at end of string or have found one of the terminators */
-    if (buf[i] != '\0') {
-        if (tc != whitespace) {
-            i++;	/* skip over terminator */
-        }
-    }
     *p = '\0';
     return i;
 }
 
+/*
+ *	p1tokenize - split buffer in place into blank-separated words
+ *
+ *	quoting is as for p1getword; each word is EOS-terminated where its
+ *	terminator was and its start stored in argv[], which is NULL-terminated.
+ *	if argv is NULL the buffer is left alone and the words only counted
+ *
+ *	returns the number of words
+ */
+int p1tokenize(char buf[], char *argv[]) {
+    int i = 0, n = 0, stop;
+
+    for (;;) {
+        while (CLASS(buf[i]) & C_BLANK)
+            i++;
+        if (buf[i] == '\0')
+            break;
+        stop = word_stop(buf, &i);
+        if (argv != NULL)
+            argv[n] = buf + i;
+        n++;
+        while (!(CLASS(buf[i]) & stop))
+            i++;
+        if (buf[i] != '\0') {
+            /* p1getword leaves a blank for the next search to skip, but
+             * a closing quote is consumed; both are gone once overwritten */
+            if (argv != NULL)
+                buf[i] = '\0';
+            i++;
+        }
+    }
+    if (argv != NULL)
+        argv[n] = NULL;
+    return n;
+}
+
 /*
  *	p1strlen - return length of string
  */
-int p1strlen(char *s) {
-    char *p = s;
+SCAN int p1strlen(char *s) {
+    int off = (uintptr_t)s % BLOCK;
+    const char *p = s - off;
+    Mask end = skip(find_byte(p, '\0'), off);
 
-    while (*p != '\0')
-        p++;
-    return (p - s);
+    while (end == 0) {
+        p += BLOCK;
+        end = find_byte(p, '\0');
+    }
+    return p - s + first(end);
 }
 
 /*
@@ -108,49 +364,32 @@ int p1strlen(char *s) {
 char *p1strdup(char *s) {
     int n = p1strlen(s) + 1;
     char *p = (char *)malloc(n);
-    int i;
 
-    if (p != NULL) {
-        for (i = 0; i < n; i++)
-            p[i] = s[i];
-    }
+    if (p != NULL)
+        memcpy(p, s, n);
     return p;
 }
 
 /*
  *	p1putint - display integer in decimal on file descriptor
  */
-static char *digits = "0123456789";
-
 void p1putint(int fd, int number) {
-    char buf[25];
-    int n, i;
+    struct p1writer w;
 
-    if (number == 0) {
-        buf[0] = '0';
-        i = 1;
-    } else {
-        for (n = number, i = 0; n != 0; i++) {
-            buf[i] = digits[n % 10];
-            n /= 10;
-        }
-    }
-    while (--i >= 0)
-        write(fd, buf+i, 1);
-    fsync(fd);
+    writer_init(&w, fd);
+    p1writer_putint(&w, number);
+    p1writer_flush(&w);
 }
 
 /*
  *	p1putstr - display string on file descriptor
  */
 void p1putstr(int fd, char *s) {
-    int n = p1strlen(s);
-    write(fd, s, n);
-    //while (*s != '\0') {
-        //write(fd, s, 1);
-        //s++;
-    //}
-    fsync(fd);
+    struct p1writer w;
+
+    writer_init(&w, fd);
+    p1writer_putstr(&w, s);
+    p1writer_flush(&w);
 }
 
 /*
@@ -213,19 +452,14 @@ void p1itoa(int number, char *buf) {
  *	p1strcpy - copy str2 into str1
  */
 void p1strcpy(char *str1, char *str2) {
-    while ((*str1++ = *str2++) != '\0')
-        ;
+    memcpy(str1, str2, p1strlen(str2) + 1);
 }
 
 /*
  *	p1strcat - concatenate str2 onto str1
  */
 void p1strcat(char *str1, char *str2) {
-    char *p;
-
-    for (p = str1; *p != '\0'; p++)	/* find end of string */
-        ;
-    p1strcpy(p, str2);
+    p1strcpy(str1 + p1strlen(str1), str2);
 }
 
 /*
@@ -233,10 +467,18 @@ void p1strcat(char *str1, char *str2) {
  *
  *	returns 1 if the first n characters are equal, 0 if not
  */
-int p1strneq(const char *s1, const char *s2, int n){
-    int i;
+SCAN int p1strneq(const char *s1, const char *s2, int n){
+    int i = 0;
 
-    for (i = 0; i < n; i++) {
+    /*
+     * a block at a time while neither read can stray into another page;
+     * the first block that differs, and the tail, go byte by byte so that
+     * nothing past the first difference is relied on
+     */
+    while (n - i >= BLOCK && !NEAR_PAGE_END(s1 + i) && !NEAR_PAGE_END(s2 + i)
+           && block_eq(s1 + i, s2 + i))
+        i += BLOCK;
+    for (; i < n; i++) {
         if (s1[i] != s2[i])
             return 0;	/* return false because chars at index i are unequal */
     }
@@ -276,3 +518,182 @@ char *p1strpack(char *st, int fw, char fc, char *buf){
     *p = '\0';
     return p;
 }
+
+/*
+ *	p1reader_create - create a reader on fd
+ *
+ *	returns NULL if unable to allocate
+ */
+P1Reader *p1reader_create(int fd) {
+    P1Reader *r = (P1Reader *)malloc(sizeof(P1Reader));
+
+    if (r != NULL) {
+        r->buf = (char *)malloc(READER_SIZE + 1);
+        if (r->buf == NULL) {
+            free(r);
+            return NULL;
+        }
+        r->fd = fd;
+        r->size = READER_SIZE;
+        r->start = r->end = 0;
+        r->eof = 0;
+    }
+    return r;
+}
+
+/*
+ *	p1reader_line - return the next line, EOS-terminated in place
+ *
+ *	the newline is removed and its length stored in *len; lines may be
+ *	of any length.  the line is valid until the next call on the reader.
+ *	returns NULL at end of file
+ */
+char *p1reader_line(P1Reader *r, int *len) {
+    int scanned = 0;
+
+    for (;;) {
+        char *line = r->buf + r->start;
+        char *nl = memchr(line + scanned, '\n', r->end - r->start - scanned);
+        int n;
+
+        if (nl != NULL || (r->eof && r->end > r->start)) {
+            if (nl == NULL)
+                nl = r->buf + r->end;   /* last line lacks a newline */
+            *nl = '\0';
+            *len = nl - line;
+            r->start += *len + (r->start + *len < r->end);
+            return line;
+        }
+        if (r->eof)
+            return NULL;
+
+        /* no whole line buffered; make room at the end and read more */
+        scanned = r->end - r->start;
+        if (r->start > 0) {
+            memmove(r->buf, line, scanned);
+            r->start = 0;
+            r->end = scanned;
+        }
+        if (r->end == r->size) {
+            char *p = (char *)realloc(r->buf, 2 * r->size + 1);
+
+            if (p == NULL)
+                return NULL;
+            r->buf = p;
+            r->size *= 2;
+        }
+        n = read(r->fd, r->buf + r->end, r->size - r->end);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            r->eof = 1;
+        else
+            r->end += n;
+    }
+}
+
+/*
+ *	p1reader_destroy - return the reader's storage to the heap
+ */
+void p1reader_destroy(P1Reader *r) {
+    free(r->buf);
+    free(r);
+}
+
+static void writer_init(struct p1writer *w, int fd) {
+    w->fd = fd;
+    w->len = 0;
+}
+
+/*
+ *	write out the iovecs in full, picking up after short writes
+ */
+static void writer_drain(int fd, struct iovec *iov, int cnt) {
+    while (cnt > 0) {
+        ssize_t n = writev(fd, iov, cnt);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+/*
+ *	p1writer_create - create a writer on fd
+ *
+ *	returns NULL if unable to allocate
+ */
+P1Writer *p1writer_create(int fd) {
+    P1Writer *w = (P1Writer *)malloc(sizeof(P1Writer));
+
+    if (w != NULL)
+        writer_init(w, fd);
+    return w;
+}
+
+/*
+ *	p1writer_putstr - queue string for output
+ *
+ *	a string that doesn't fit goes out along with what's queued in one
+ *	writev, without being copied
+ */
+void p1writer_putstr(P1Writer *w, char *s) {
+    int n = p1strlen(s);
+
+    if (w->len + n <= WRITER_SIZE) {
+        memcpy(w->buf + w->len, s, n);
+        w->len += n;
+    } else {
+        struct iovec iov[2];
+
+        iov[0].iov_base = w->buf;
+        iov[0].iov_len = w->len;
+        iov[1].iov_base = s;
+        iov[1].iov_len = n;
+        writer_drain(w->fd, iov, 2);
+        w->len = 0;
+    }
+}
+
+/*
+ *	p1writer_putint - queue integer in decimal for output
+ */
+void p1writer_putint(P1Writer *w, int number) {
+    char buf[25];
+
+    p1itoa(number, buf);
+    p1writer_putstr(w, buf);
+}
+
+/*
+ *	p1writer_flush - write out everything queued so far
+ */
+void p1writer_flush(P1Writer *w) {
+    struct iovec iov;
+
+    if (w->len > 0) {
+        iov.iov_base = w->buf;
+        iov.iov_len = w->len;
+        writer_drain(w->fd, &iov, 1);
+        w->len = 0;
+    }
+}
+
+/*
+ *	p1writer_destroy - flush, then return the writer's storage to the heap
+ */
+void p1writer_destroy(P1Writer *w) {
+    p1writer_flush(w);
+    free(w);
+}
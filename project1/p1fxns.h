@@ -10,6 +10,9 @@
  *	p1getline - return EOS-terminated character array from fd
  *
  *	returns number of characters in buf as result, 0 if end of file
+ *
+ *	never consumes more of fd than the line returned; prefer a P1Reader
+ *	when reading a whole file
  */
 int p1getline(int fd, char buf[], int size);
 
@@ -29,6 +32,17 @@ int p1strchr(char buf[], char c);
  */
 int p1getword(char buf[], int i, char word[]);
 
+/*
+ *	p1tokenize - split buffer in place into blank-separated words
+ *
+ *	quoting is as for p1getword; the start of each word is stored in
+ *	argv[], which must have room for the words and a terminating NULL.
+ *	if argv is NULL the buffer is left alone and the words only counted
+ *
+ *	returns the number of words
+ */
+int p1tokenize(char buf[], char *argv[]);
+
 /*
  *	p1strlen - return length of string
  */
@@ -100,4 +114,89 @@ int p1strneq(const char *s1, const char *s2, int n);
  */
 char *p1strpack(char *st, int fw, char fc, char *buf);
 
+/*
+ *	buffered I/O
+ *
+ *	a P1Reader reads its fd in large blocks and hands back lines sliced
+ *	out of its buffer; a P1Writer gathers output and issues one write
+ *	(or a writev, for strings too large to copy) when it fills or is
+ *	flushed.  neither should be mixed with other reads/writes on the fd
+ */
+typedef struct p1reader P1Reader;
+typedef struct p1writer P1Writer;
+
+/*
+ *	p1reader_create - create a reader on fd
+ *
+ *	returns NULL if unable to allocate
+ */
+P1Reader *p1reader_create(int fd);
+
+/*
+ *	p1reader_line - return the next line, EOS-terminated in place
+ *
+ *	the newline is removed and its length stored in *len; lines may be
+ *	of any length.  the line is valid until the next call on the reader.
+ *	returns NULL at end of file
+ */
+char *p1reader_line(P1Reader *r, int *len);
+
+/*
+ *	p1reader_destroy - return the reader's storage to the heap
+ *
+ *	the fd is not closed
+ */
+void p1reader_destroy(P1Reader *r);
+
+/*
+ *	p1writer_create - create a writer on fd
+ *
+ *	returns NULL if unable to allocate
+ */
+P1Writer *p1writer_create(int fd);
+
+/*
+ *	p1writer_putstr - queue string for output
+ */
+void p1writer_putstr(P1Writer *w, char *s);
+
+/*
+ *	p1writer_putint - queue integer in decimal for output
+ */
+void p1writer_putint(P1Writer *w, int number);
+
+/*
+ *	p1writer_flush - write out everything queued so far
+ */
+void p1writer_flush(P1Writer *w);
+
+/*
+ *	p1writer_destroy - flush, then return the writer's storage to the heap
+ *
+ *	the fd is not closed
+ */
+void p1writer_destroy(P1Writer *w);
+
+/*
+ *	a workload - the lines of a file, each split into an argv array
+ *	ready for execvp.  the arrays and the words they point at share a
+ *	single allocation, so a workload is parsed once and freed at once
+ */
+typedef struct p1workload {
+    int count;          /* number of lines */
+    char ***argv;       /* argv[i] is line i's words, NULL-terminated */
+} P1Workload;
+
+/*
+ *	p1workload_read - read up to limit lines (all if limit < 0) from r
+ *
+ *	a blank line has an empty argv.  returns NULL if unable to allocate
+ */
+P1Workload *p1workload_read(P1Reader *r, int limit);
+
+/*
+ *	p1workload_destroy - return the workload's storage to the heap
+ */
+void p1workload_destroy(P1Workload *w);
+
 #endif	/* _P1FXNS_H_ */
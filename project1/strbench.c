@@ -0,0 +1,295 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "p1fxns.h"
+
+/*
+ * a microbenchmark for the string primitives in p1fxns: times p1strlen,
+ * p1strchr, p1strneq, p1strcpy and p1getword on strings of several lengths
+ * against the byte-at-a-time versions they replaced and against glibc
+ *
+ * usage: strbench [-bytes N] [-check N]
+ *
+ * each measurement touches about -bytes bytes in total.  before timing,
+ * -check random strings at random alignments are run through both the old
+ * and new versions, and any disagreement is reported and fails the run
+ */
+
+#define MAX_LEN 4096
+#define PAD 64
+
+static int lengths[] = { 7, 31, 100, 1000, 4000 };
+#define N_LENGTHS ((int)(sizeof(lengths) / sizeof(lengths[0])))
+
+static volatile long sink;
+
+/* keeps the compiler from hoisting calls on an unchanging string */
+#define TOUCH(p) __asm__ volatile("" : : "r"(p) : "memory")
+
+/*
+ * the byte-at-a-time versions, as p1fxns had them
+ */
+static int old_strlen(char *s) {
+    char *p = s;
+
+    while (*p != '\0')
+        p++;
+    return (p - s);
+}
+
+static int old_strchr(char buf[], char c) {
+    int i;
+
+    for (i = 0; buf[i] != '\0'; i++)
+        if (buf[i] == c)
+            return i;
+    return -1;
+}
+
+static int old_strneq(const char *s1, const char *s2, int n) {
+    int i;
+
+    for (i = 0; i < n; i++)
+        if (s1[i] != s2[i])
+            return 0;
+    return 1;
+}
+
+static void old_strcpy(char *str1, char *str2) {
+    while ((*str1++ = *str2++) != '\0')
+        ;
+}
+
+static int old_getword(char buf[], int i, char word[]) {
+    char *tc, *p;
+
+    while (old_strchr(" \t", buf[i]) != -1)
+        i++;
+    if (buf[i] == '\0')
+        return -1;
+    p = word;
+    switch (buf[i]) {
+    case '\'': tc = "'"; i++; break;
+    case '"': tc = "\""; i++; break;
+    default: tc = " \t"; break;
+    }
+    while (buf[i] != '\0') {
+        if (old_strchr(tc, buf[i]) != -1)
+            break;
+        *p++ = buf[i];
+        i++;
+    }
+    if (buf[i] != '\0' && tc[0] != ' ')
+        i++;
+    *p = '\0';
+    return i;
+}
+
+/*
+ * glibc has no p1getword; strspn/strcspn is the nearest idiom
+ */
+static int libc_getword(char buf[], int i, char word[]) {
+    int n;
+
+    i += strspn(buf + i, " \t");
+    if (buf[i] == '\0')
+        return -1;
+    n = strcspn(buf + i, " \t");
+    memcpy(word, buf + i, n);
+    word[n] = '\0';
+    return i + n;
+}
+
+static int libc_strchr(char buf[], char c) {
+    char *p = strchr(buf, c);
+
+    return (p == NULL || c == '\0') ? -1 : p - buf;
+}
+
+static int libc_strneq(const char *s1, const char *s2, int n) {
+    return strncmp(s1, s2, n) == 0;
+}
+
+static long long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* fills s with len random letters and, if words, blanks and quotes */
+static void fill(char *s, int len, int words) {
+    static char alphabet[] = "abcdefghijklmnopqrstuvwxyz-=./0123456789";
+    int i;
+
+    for (i = 0; i < len; i++) {
+        int r = rand() % 64;
+
+        if (words && r < 8)
+            s[i] = (r < 6) ? ' ' : (r == 6) ? '\t' : "'\""[rand() % 2];
+        else
+            s[i] = alphabet[r % (sizeof(alphabet) - 1)];
+    }
+    s[len] = '\0';
+}
+
+/* old and new versions agree on n random strings; returns mismatches */
+static int check(int n) {
+    static char a[MAX_LEN + PAD], b[MAX_LEN + PAD];
+    static char w1[MAX_LEN + PAD], w2[MAX_LEN + PAD];
+    int bad = 0, t;
+
+    for (t = 0; t < n; t++) {
+        int len = rand() % ((t % 4 == 0) ? MAX_LEN : 80);
+        int oa = rand() % 32, ob = rand() % 32, k, i, j;
+        char *s = a + oa, *u = b + ob, c;
+
+        fill(s, len, t % 2);
+        c = (rand() % 8 == 0) ? '\0' : (rand() % 2) ? s[rand() % (len + 1)]
+            : 'A' + rand() % 26;
+        if (p1strlen(s) != old_strlen(s))
+            bad++, fprintf(stderr, "p1strlen differs at length %d\n", len);
+        if (p1strchr(s, c) != old_strchr(s, c))
+            bad++, fprintf(stderr, "p1strchr differs at length %d\n", len);
+
+        memcpy(u, s, len + 1);
+        if (len > 0 && rand() % 2)
+            u[rand() % len] ^= 1 << (rand() % 7);
+        k = rand() % (len + 2);
+        if (p1strneq(s, u, k) != old_strneq(s, u, k))
+            bad++, fprintf(stderr, "p1strneq differs at length %d\n", len);
+
+        memset(b, 'x', sizeof(b));
+        p1strcpy(u, s);
+        if (memcmp(u, s, len + 1) != 0 || u[len + 1] != 'x')
+            bad++, fprintf(stderr, "p1strcpy differs at length %d\n", len);
+
+        for (i = 0; i >= 0; i = j) {
+            j = old_getword(s, i, w2);
+            if (p1getword(s, i, w1) != j || (j >= 0 && strcmp(w1, w2) != 0)) {
+                bad++;
+                fprintf(stderr, "p1getword differs at length %d\n", len);
+                break;
+            }
+        }
+    }
+    return bad;
+}
+
+/* prints one row: ns per call for the old, p1 and glibc versions */
+static void row(char *name, int len, long long ns[3], long calls) {
+    printf("%-10s %5d %10.1f %10.1f %10.1f %8.1fx\n", name, len,
+           (double)ns[0] / calls, (double)ns[1] / calls, (double)ns[2] / calls,
+           ns[1] > 0 ? (double)ns[0] / ns[1] : 0.0);
+}
+
+int main(int argc, char **argv) {
+    static char a[MAX_LEN + PAD], b[MAX_LEN + PAD], word[MAX_LEN + PAD];
+    long bytes = 1L << 27, checks = 20000, calls, c;
+    long long start, ns[3];
+    int i, l, v;
+
+/*
+ * process command line arguments
+ */
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-bytes") == 0 && i + 1 < argc) {
+            bytes = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-check") == 0 && i + 1 < argc) {
+            checks = atol(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: strbench [-bytes N] [-check N]\n");
+            exit(1);
+        }
+    }
+    if (bytes < 1 || checks < 0) {
+        fprintf(stderr, "usage: strbench [-bytes N] [-check N]\n");
+        exit(1);
+    }
+
+    srand(415);
+    if (check(checks) != 0)
+        exit(1);
+    printf("%ld random strings checked against the old versions\n\n", checks);
+
+    printf("%-10s %5s %10s %10s %10s %9s\n", "function", "len", "old ns",
+           "p1 ns", "glibc ns", "speedup");
+    for (l = 0; l < N_LENGTHS; l++) {
+        int len = lengths[l];
+        char *s = a + 3, *u = b + 5;    /* deliberately misaligned */
+
+        calls = bytes / len + 1;
+        fill(s, len, 0);
+        memcpy(u, s, len + 1);
+
+        for (v = 0; v < 3; v++) {
+            start = now_ns();
+            for (c = 0; c < calls; c++) {
+                TOUCH(s);
+                sink += (v == 0) ? old_strlen(s) : (v == 1) ? p1strlen(s)
+                        : (long)strlen(s);
+            }
+            ns[v] = now_ns() - start;
+        }
+        row("strlen", len, ns, calls);
+
+        for (v = 0; v < 3; v++) {
+            start = now_ns();
+            for (c = 0; c < calls; c++) {
+                TOUCH(s);
+                sink += (v == 0) ? old_strchr(s, 'A') : (v == 1)
+                        ? p1strchr(s, 'A') : libc_strchr(s, 'A');
+            }
+            ns[v] = now_ns() - start;
+        }
+        row("strchr", len, ns, calls);
+
+        for (v = 0; v < 3; v++) {
+            start = now_ns();
+            for (c = 0; c < calls; c++) {
+                TOUCH(s);
+                TOUCH(u);
+                sink += (v == 0) ? old_strneq(s, u, len) : (v == 1)
+                        ? p1strneq(s, u, len) : libc_strneq(s, u, len);
+            }
+            ns[v] = now_ns() - start;
+        }
+        row("strneq", len, ns, calls);
+
+        for (v = 0; v < 3; v++) {
+            start = now_ns();
+            for (c = 0; c < calls; c++) {
+                TOUCH(s);
+                if (v == 0)
+                    old_strcpy(u, s);
+                else if (v == 1)
+                    p1strcpy(u, s);
+                else
+                    strcpy(u, s);
+                TOUCH(u);
+            }
+            ns[v] = now_ns() - start;
+        }
+        row("strcpy", len, ns, calls);
+
+        /* a line of words of a few bytes each, taken apart word by word */
+        fill(s, len, 0);
+        for (i = 5; i < len; i += 3 + rand() % 8)
+            s[i] = ' ';
+        for (v = 0; v < 3; v++) {
+            start = now_ns();
+            for (c = 0; c < calls; c++) {
+                int j = 0;
+
+                TOUCH(s);
+                while ((j = (v == 0) ? old_getword(s, j, word) : (v == 1)
+                        ? p1getword(s, j, word) : libc_getword(s, j, word)) >= 0)
+                    sink += word[0];
+            }
+            ns[v] = now_ns() - start;
+        }
+        row("getword", len, ns, calls);
+    }
+    return 0;
+}
@@ -0,0 +1,188 @@
+/*
+ *	scheduling trace recorder for uspsv4 --trace (see trace.h)
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include "trace.h"
+
+/*
+ *	TRACE_BUFFERS buffers of TRACE_RECORDS records each go round between
+ *	the scheduler, which fills one at a time, and the writer, which
+ *	empties them in the order they filled.  the lock is only taken when
+ *	a buffer changes hands
+ */
+#define TRACE_RECORDS 4096
+#define TRACE_BUFFERS 4
+
+typedef struct tracebuffer {
+    int n;
+    UspsTraceRecord records[TRACE_RECORDS];
+} TraceBuffer;
+
+static int fd = -1;
+static TraceBuffer *buffers;
+static TraceBuffer *current;    /* being filled; NULL if none was free */
+static TraceBuffer *full[TRACE_BUFFERS];   /* for the writer, oldest first */
+static TraceBuffer *empty[TRACE_BUFFERS];
+static int full_head, n_full, n_empty;
+static int closing, failed;
+static long records, dropped;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t filled = PTHREAD_COND_INITIALIZER;
+static pthread_t writer;
+
+static int write_all(void *buf, long size) {
+    char *p = (char *) buf;
+    long n;
+
+    while (size > 0) {
+        if ((n = write(fd, p, size)) <= 0)
+            return -1;
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/*
+ *	the writer thread: waits for full buffers and writes them out until
+ *	the trace is closed and there are none left.  after a failed write
+ *	it keeps emptying buffers, so the scheduler never runs out, but
+ *	writes nothing more
+ */
+static void *write_out(void *unused) {
+    TraceBuffer *buf;
+
+    (void) unused;
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        while (n_full == 0 && !closing)
+            pthread_cond_wait(&filled, &lock);
+        if (n_full == 0) {
+            pthread_mutex_unlock(&lock);
+            return NULL;
+        }
+        buf = full[full_head];
+        full_head = (full_head + 1) % TRACE_BUFFERS;
+        n_full--;
+        pthread_mutex_unlock(&lock);
+
+        if (!failed && write_all(buf->records,
+                                 buf->n * (long) sizeof(UspsTraceRecord)) < 0)
+            failed = 1;
+
+        pthread_mutex_lock(&lock);
+        buf->n = 0;
+        empty[n_empty++] = buf;
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+/*
+ *	passes the current buffer, if any, to the writer and takes an empty
+ *	one, if there is one
+ */
+static void hand_off(void) {
+    pthread_mutex_lock(&lock);
+    if (current != NULL) {
+        full[(full_head + n_full) % TRACE_BUFFERS] = current;
+        n_full++;
+        pthread_cond_signal(&filled);
+    }
+    current = (n_empty > 0) ? empty[--n_empty] : NULL;
+    pthread_mutex_unlock(&lock);
+}
+
+int usps_trace_open(char *path, UspsTraceHeader *header) {
+    sigset_t all, old;
+    int i, err;
+
+    header->magic = TRACE_MAGIC;
+    header->version = TRACE_VERSION;
+    header->record_size = sizeof(UspsTraceRecord);
+    header->records = header->dropped = 0;
+    buffers = (TraceBuffer *) malloc(TRACE_BUFFERS * sizeof(TraceBuffer));
+    if (buffers == NULL)
+        return -1;
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0
+        || write_all(header, sizeof(UspsTraceHeader)) < 0) {
+        if (fd >= 0)
+            close(fd);
+        fd = -1;
+        free(buffers);
+        return -1;
+    }
+    for (i = 0; i < TRACE_BUFFERS; i++) {
+        buffers[i].n = 0;
+        empty[i] = &buffers[i];
+    }
+    n_empty = TRACE_BUFFERS;
+    current = empty[--n_empty];
+
+    // Signals are read through a signalfd, which only works while every
+    // thread blocks them, so the writer starts with all of them blocked
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    err = pthread_create(&writer, NULL, write_out, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) {
+        close(fd);
+        fd = -1;
+        free(buffers);
+        return -1;
+    }
+    return 0;
+}
+
+void usps_trace(int type, Job *job, int arg, long long ns) {
+    UspsTraceRecord *r;
+
+    if (current == NULL) {
+        if (fd < 0)
+            return;
+        hand_off();
+        if (current == NULL) {
+            dropped++;
+            return;
+        }
+    }
+    r = &current->records[current->n++];
+    r->ns = ns;
+    r->pid = job->pid;
+    r->job = job->index;
+    r->slot = job->slot;
+    r->type = type;
+    r->level = job->level;
+    r->arg = arg;
+    records++;
+    if (current->n == TRACE_RECORDS)
+        hand_off();
+}
+
+int usps_trace_close(UspsTraceHeader *header) {
+    if (fd < 0)
+        return -1;
+    if (current != NULL && current->n > 0)
+        hand_off();
+    pthread_mutex_lock(&lock);
+    closing = 1;
+    pthread_cond_signal(&filled);
+    pthread_mutex_unlock(&lock);
+    pthread_join(writer, NULL);
+
+    header->records = records;
+    header->dropped = dropped;
+    if (pwrite(fd, header, sizeof(UspsTraceHeader), 0)
+        != (ssize_t) sizeof(UspsTraceHeader))
+        failed = 1;
+    if (close(fd) < 0)
+        failed = 1;
+    fd = -1;
+    current = NULL;
+    free(buffers);
+    return failed ? -1 : 0;
+}
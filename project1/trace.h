@@ -0,0 +1,77 @@
+/*
+ *	binary scheduling trace written by uspsv4 --trace, read by uspstrace
+ *
+ *	the file is a UspsTraceHeader, then fixed-size UspsTraceRecords in
+ *	the order the scheduler made them, one per scheduling event.  the
+ *	scheduler only ever stores a record into a buffer in memory; full
+ *	buffers are written out by a thread of their own, so the event loop
+ *	never waits on the disk.  if the writer falls so far behind that no
+ *	buffer is free, records are dropped and counted rather than waited
+ *	for.  records and dropped in the header are filled in when the trace
+ *	is closed, so both are 0 in a trace that was cut short
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include "usps.h"
+
+#define TRACE_MAGIC   0x55505452        /* "UPTR"; "RTPU" on disk */
+#define TRACE_VERSION 1
+
+/*
+ *	event types
+ */
+#define TRACE_SPAWN    0    /* launched, stopped until dispatched */
+#define TRACE_DISPATCH 1    /* given its slot for a quantum; arg is the quantum in us */
+#define TRACE_PREEMPT  2    /* stopped and put back on a queue */
+#define TRACE_EXIT     3    /* reaped; arg is its wait status */
+#define TRACE_PARK     4    /* taken out of rotation under memory pressure */
+#define TRACE_UNPARK   5    /* let back in */
+#define TRACE_TYPES    6
+
+typedef struct uspstraceheader {
+    unsigned int magic;
+    unsigned int version;
+    int record_size;            /* sizeof(UspsTraceRecord) */
+    int n_slots;
+    char policy[16];
+    long long quantum_ns;
+    long long started_ns;       /* CLOCK_MONOTONIC when tracing began */
+    long records;
+    long dropped;
+} UspsTraceHeader;
+
+typedef struct uspstracerecord {
+    long long ns;               /* CLOCK_MONOTONIC */
+    int pid;
+    int job;                    /* its index */
+    short slot;                 /* slot it's queued on or running on */
+    unsigned char type;
+    unsigned char level;        /* feedback queue level */
+    int arg;
+} UspsTraceRecord;
+
+/*
+ *	usps_trace_open - creates `path' and starts the thread that writes it
+ *
+ *	`header' supplies the run's description; returns -1 on failure
+ */
+int usps_trace_open(char *path, UspsTraceHeader *header);
+
+/*
+ *	usps_trace - records an event that happened to `job' at `ns'
+ *
+ *	no system calls unless a buffer has just filled, and then only to
+ *	hand it to the writer
+ */
+void usps_trace(int type, Job *job, int arg, long long ns);
+
+/*
+ *	usps_trace_close - writes out what's left, waits for the writer and
+ *	fills in the header's counts, which are returned through `header';
+ *	returns -1 if any of the trace couldn't be written
+ */
+int usps_trace_close(UspsTraceHeader *header);
+
+#endif	/* _TRACE_H_ */
@@ -0,0 +1,386 @@
+/*
+ *	shared pieces of the event-driven USPS scheduler (uspsv4)
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "p1fxns.h"
+#include "usps.h"
+
+/*
+ *	run queue
+ */
+void usps_rq_init(RunQueue *rq) {
+    rq->head = NULL;
+    rq->length = 0;
+}
+
+void usps_rq_push(RunQueue *rq, Job *job) {
+    if (rq->head == NULL) {
+        job->prev = job->next = job;
+        rq->head = job;
+    } else {
+        Job *tail = rq->head->prev;
+
+        job->prev = tail;
+        job->next = rq->head;
+        tail->next = job;
+        rq->head->prev = job;
+    }
+    rq->length++;
+}
+
+/*
+ *	walks back from the tail, since a job that has just been charged
+ *	for a slice usually has one of the largest passes; equal passes keep
+ *	the order they arrived in
+ */
+void usps_rq_push_pass(RunQueue *rq, Job *job) {
+    Job *after;
+
+    if (rq->head == NULL || job->pass < rq->head->pass) {
+        usps_rq_push(rq, job);
+        if (job->pass < rq->head->pass)
+            rq->head = job;
+        return;
+    }
+    for (after = rq->head->prev; after->pass > job->pass; after = after->prev)
+        ;
+    job->prev = after;
+    job->next = after->next;
+    after->next->prev = job;
+    after->next = job;
+    rq->length++;
+}
+
+void usps_rq_remove(RunQueue *rq, Job *job) {
+    if (job->next == job) {
+        rq->head = NULL;
+    } else {
+        job->prev->next = job->next;
+        job->next->prev = job->prev;
+        if (rq->head == job)
+            rq->head = job->next;
+    }
+    job->prev = job->next = NULL;
+    rq->length--;
+}
+
+Job *usps_rq_pop(RunQueue *rq) {
+    Job *job = rq->head;
+
+    if (job != NULL)
+        usps_rq_remove(rq, job);
+    return job;
+}
+
+/*
+ *	pid table - linear probing with tombstones, sized to a power of two
+ *	at least twice the number of jobs so probes stay short.  once live
+ *	entries and tombstones fill half of it, it's rebuilt without the
+ *	tombstones, twice as large if the live entries alone need it
+ */
+#define TOMBSTONE ((Job *) 1)
+
+struct pidtable {
+    int mask;
+    int count;      /* live entries */
+    int used;       /* live entries and tombstones */
+    Job **slots;
+};
+
+static Job **pids_alloc(int capacity, int *mask) {
+    int size = 16;
+
+    while (size < 2 * capacity)
+        size *= 2;
+    *mask = size - 1;
+    return (Job **) calloc(size, sizeof(Job *));
+}
+
+PidTable *usps_pids_create(int capacity) {
+    PidTable *pt = (PidTable *) malloc(sizeof(PidTable));
+
+    if (pt == NULL)
+        return NULL;
+    pt->count = pt->used = 0;
+    if ((pt->slots = pids_alloc(capacity, &pt->mask)) == NULL) {
+        free(pt);
+        return NULL;
+    }
+    return pt;
+}
+
+void usps_pids_destroy(PidTable *pt) {
+    free(pt->slots);
+    free(pt);
+}
+
+static int pids_rebuild(PidTable *pt) {
+    Job **old = pt->slots;
+    int size = pt->mask + 1, i;
+
+    if ((pt->slots = pids_alloc(2 * (pt->count + 1), &pt->mask)) == NULL) {
+        pt->slots = old;
+        pt->mask = size - 1;
+        return -1;
+    }
+    pt->count = pt->used = 0;
+    for (i = 0; i < size; i++) {
+        if (old[i] != NULL && old[i] != TOMBSTONE)
+            usps_pids_put(pt, old[i]);
+    }
+    free(old);
+    return 0;
+}
+
+int usps_pids_put(PidTable *pt, Job *job) {
+    int i;
+
+    if (2 * (pt->used + 1) > pt->mask + 1 && pids_rebuild(pt) < 0)
+        return -1;
+    i = job->pid & pt->mask;
+    while (pt->slots[i] != NULL && pt->slots[i] != TOMBSTONE)
+        i = (i + 1) & pt->mask;
+    if (pt->slots[i] == NULL)
+        pt->used++;
+    pt->slots[i] = job;
+    pt->count++;
+    return 0;
+}
+
+static int pids_find(PidTable *pt, pid_t pid) {
+    int i = pid & pt->mask;
+
+    while (pt->slots[i] != NULL) {
+        if (pt->slots[i] != TOMBSTONE && pt->slots[i]->pid == pid)
+            return i;
+        i = (i + 1) & pt->mask;
+    }
+    return -1;
+}
+
+Job *usps_pids_get(PidTable *pt, pid_t pid) {
+    int i = pids_find(pt, pid);
+
+    return (i < 0) ? NULL : pt->slots[i];
+}
+
+void usps_pids_remove(PidTable *pt, pid_t pid) {
+    int i = pids_find(pt, pid);
+
+    if (i >= 0) {
+        pt->slots[i] = TOMBSTONE;
+        pt->count--;
+    }
+}
+
+/*
+ *	clock
+ */
+long long usps_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ *	reads a small file into buf; returns bytes read or -1
+ */
+static int read_file(char *path, char *buf, int size) {
+    int fd, n;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+    n = read(fd, buf, size - 1);
+    close(fd);
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+    return n;
+}
+
+/*
+ *	reads a small /proc file for `pid' into buf; returns bytes read or -1
+ */
+static int read_proc(pid_t pid, char *file, char *buf, int size) {
+    char path[64], num[16];
+
+    p1strcpy(path, "/proc/");
+    p1itoa((int) pid, num);
+    p1strcat(path, num);
+    p1strcat(path, file);
+    return read_file(path, buf, size);
+}
+
+long long usps_cpu_ns(pid_t pid) {
+    static long long tick_ns = 0;
+    char buf[512], *p;
+    long long ticks = 0;
+    int field;
+
+    // First field of schedstat is time spent on the CPU in nanoseconds
+    if (read_proc(pid, "/schedstat", buf, sizeof(buf)) > 0)
+        return strtoll(buf, NULL, 10);
+
+    // Otherwise utime and stime are fields 14 and 15 of stat; the command
+    // name in field 2 may hold spaces, so count from its closing paren
+    if (read_proc(pid, "/stat", buf, sizeof(buf)) < 0)
+        return -1;
+    if (tick_ns == 0)
+        tick_ns = 1000000000LL / sysconf(_SC_CLK_TCK);
+    for (p = buf + p1strlen(buf); p > buf && *p != ')'; p--)
+        ;
+    for (field = 2; *p != '\0' && field < 15; p++) {
+        if (*p == ' ' && ++field >= 14)
+            ticks += strtoll(p + 1, NULL, 10);
+    }
+    return ticks * tick_ns;
+}
+
+int usps_ctxsw(pid_t pid, long *voluntary, long *involuntary) {
+    char buf[4096], *p;
+    int found = 0;
+
+    if (read_proc(pid, "/status", buf, sizeof(buf)) < 0)
+        return -1;
+    for (p = buf; *p != '\0'; p++) {
+        if (p1strneq(p, "voluntary_ctxt_switches:", 24)) {
+            *voluntary = strtol(p + 24, NULL, 10);
+            found++;
+        } else if (p1strneq(p, "nonvoluntary_ctxt_switches:", 27)) {
+            *involuntary = strtol(p + 27, NULL, 10);
+            found++;
+        }
+        while (*p != '\n' && p[1] != '\0')
+            p++;
+    }
+    return (found == 2) ? 0 : -1;
+}
+
+long long usps_rss(pid_t pid) {
+    static long page = 0;
+    char buf[256], *p;
+
+    // The second field of statm is the resident set, in pages
+    if (read_proc(pid, "/statm", buf, sizeof(buf)) < 0)
+        return -1;
+    if (page == 0)
+        page = sysconf(_SC_PAGESIZE);
+    for (p = buf; *p != ' ' && *p != '\0'; p++)
+        ;
+    return strtoll(p, NULL, 10) * page;
+}
+
+long long usps_pressure_us(char *resource) {
+    char path[64], buf[512];
+    int i;
+
+    // The first line is "some avg10=... avg60=... avg300=... total=N"
+    p1strcpy(path, "/proc/pressure/");
+    p1strcat(path, resource);
+    if (read_file(path, buf, sizeof(buf)) < 0 || !p1strneq(buf, "some ", 5))
+        return -1;
+    for (i = 0; buf[i] != '\n' && buf[i] != '\0'; i++) {
+        if (p1strneq(buf + i, "total=", 6))
+            return strtoll(buf + i + 6, NULL, 10);
+    }
+    return -1;
+}
+
+long long usps_parse_msec(char *s) {
+    long long ns = 0, scale = 1000000;
+
+    if (*s < '0' || *s > '9')
+        return -1;
+    for (; *s >= '0' && *s <= '9'; s++)
+        ns = 10 * ns + (*s - '0') * scale;
+    if (*s == '.') {
+        for (s++; *s >= '0' && *s <= '9'; s++) {
+            scale /= 10;
+            ns += (*s - '0') * scale;
+        }
+    }
+    if (*s != '\0' || ns <= 0)
+        return -1;
+    return ns;
+}
+
+/*
+ *	statistics
+ */
+void usps_stat_init(UspsStat *st) {
+    st->n = 0;
+    st->min = st->max = 0;
+    st->sum = st->sumsq = 0.0;
+}
+
+void usps_stat_add(UspsStat *st, long long sample) {
+    if (st->n == 0 || sample < st->min)
+        st->min = sample;
+    if (st->n == 0 || sample > st->max)
+        st->max = sample;
+    st->n++;
+    st->sum += sample;
+    st->sumsq += (double) sample * sample;
+}
+
+void usps_stat_print(int fd, char *label, UspsStat *st) {
+    double mean, var;
+
+    if (st->n == 0) {
+        dprintf(fd, "%-18s no samples\n", label);
+        return;
+    }
+    mean = st->sum / st->n;
+    var = st->sumsq / st->n - mean * mean;
+    dprintf(fd, "%-18s n=%ld mean=%.1fus sd=%.1fus min=%.1fus max=%.1fus\n",
+            label, st->n, mean / 1000.0, sqrt(var > 0.0 ? var : 0.0) / 1000.0,
+            st->min / 1000.0, st->max / 1000.0);
+}
+
+/*
+ *	histogram - samples under 4ns get a bucket each; above that the
+ *	bucket is the power of two and the two bits below the top one
+ */
+int usps_hist_bucket(long long ns) {
+    int b = 0;
+
+    if (ns < 4)
+        return (ns < 0) ? 0 : (int) ns;
+    while ((ns >> b) > 1)
+        b++;
+    return 4 * (b - 1) + (int) ((ns >> (b - 2)) & 3);
+}
+
+static long long hist_value(int bucket) {
+    int b;
+    long long width;
+
+    if (bucket < 4)
+        return bucket;
+    b = bucket / 4 + 1;
+    width = 1LL << (b - 2);
+    return (4 + bucket % 4) * width + width / 2;
+}
+
+long long usps_hist_percentile(long *hist, int n, double p) {
+    long total = 0, seen = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+        total += hist[i];
+    if (total == 0)
+        return -1;
+    for (i = 0; i < n; i++) {
+        seen += hist[i];
+        if (seen >= p / 100.0 * total)
+            return hist_value(i);
+    }
+    return hist_value(n - 1);
+}
@@ -0,0 +1,183 @@
+/*
+ *	shared pieces of the event-driven USPS scheduler (uspsv4)
+ *
+ *	jobs, the run queue, a pid lookup table and the clock and
+ *	statistics helpers used to measure the scheduler itself
+ */
+
+#ifndef _USPS_H_
+#define _USPS_H_
+
+#include <sys/types.h>
+
+/*
+ *	job states
+ */
+#define JOB_READY   0   /* stopped, waiting in the run queue */
+#define JOB_RUNNING 1   /* holding the CPU for a quantum */
+#define JOB_EXITED  2   /* reaped */
+#define JOB_PENDING 3   /* not launched yet: waiting on jobs it runs after */
+#define JOB_SKIPPED 4   /* never launched: a job it runs after failed */
+#define JOB_PARKED  5   /* stopped and out of the run queues for a while */
+
+/*
+ *	one workload line and the process running it
+ */
+typedef struct job Job;
+struct job {
+    int index;              /* workload order, then order streamed in */
+    char **argv;            /* the line split into words, for exec */
+    pid_t pid;
+    int state;
+    int status;             /* wait status once exited */
+
+    Job *prev, *next;       /* run queue links */
+    int slot;               /* CPU slot whose queue the job is on */
+    int cpu;                /* core the job is pinned to, -1 if none */
+
+    long long started_ns;   /* when the job was launched */
+    long long finished_ns;  /* when it was reaped */
+    int slices;             /* quanta it has been dispatched for */
+
+    int level;              /* feedback queue priority, 0 is highest */
+    long long cpu_ns;       /* CPU time measured over its slices */
+    long long slice_cpu_ns; /* CPU time when the current slice began */
+
+    long long quantum_ns;   /* its own quantum, under the adaptive policy */
+    long long burst_ns;     /* average CPU time it runs before blocking */
+    long nvcsw, nivcsw;     /* voluntary and involuntary context switches */
+    long slice_nvcsw;       /* the counts when the current slice began */
+    long slice_nivcsw;
+
+    int share;              /* its share=N annotation, 1 if none */
+    long long stride;       /* STRIDE1 / share */
+    long long pass;         /* stride scheduling virtual time */
+
+    char *id;               /* its id=NAME annotation, NULL if none */
+    Job **after;            /* the jobs it has to wait for */
+    int n_after;
+    Job **dependents;       /* the jobs waiting for it */
+    int n_dependents;
+    int max_dependents;     /* room in a list of its own, 0 if it has none */
+    int pending;            /* how many of `after' haven't exited yet */
+
+    long long ready_ns;     /* when it last joined a run queue */
+    long long wait_ns;      /* time spent on run queues */
+    long long run_ns;       /* time spent holding a slot */
+
+    int out_fd;             /* pipe its output is captured from, -1 if not */
+    int log_fd;             /* and the file that output goes to */
+    long long out_bytes;    /* how much of it there has been */
+
+    long long rss;          /* resident set when last sampled, in bytes */
+    long long max_rss;      /* the largest it has been seen */
+};
+
+/*
+ *	run queue - circular doubly-linked list of jobs, so that a job
+ *	can be unlinked in O(1) wherever it is when it exits
+ */
+typedef struct runqueue {
+    Job *head;
+    int length;
+} RunQueue;
+
+void usps_rq_init(RunQueue *rq);
+void usps_rq_push(RunQueue *rq, Job *job);     /* append at the tail */
+void usps_rq_push_pass(RunQueue *rq, Job *job);/* keep in order of pass */
+Job *usps_rq_pop(RunQueue *rq);                /* NULL if empty */
+void usps_rq_remove(RunQueue *rq, Job *job);
+
+/*
+ *	pid table - open-addressed map from pid to job
+ *
+ *	usps_pids_create returns NULL if allocation fails; the table grows
+ *	past its initial capacity as needed, and usps_pids_put returns -1 if
+ *	it couldn't
+ */
+typedef struct pidtable PidTable;
+
+PidTable *usps_pids_create(int capacity);
+void usps_pids_destroy(PidTable *pt);
+int usps_pids_put(PidTable *pt, Job *job);
+Job *usps_pids_get(PidTable *pt, pid_t pid);   /* NULL if not found */
+void usps_pids_remove(PidTable *pt, pid_t pid);
+
+/*
+ *	usps_now_ns - CLOCK_MONOTONIC in nanoseconds
+ */
+long long usps_now_ns(void);
+
+/*
+ *	usps_cpu_ns - CPU time consumed so far by `pid', in nanoseconds
+ *
+ *	read from /proc/<pid>/schedstat where available, otherwise from the
+ *	utime and stime clock ticks in /proc/<pid>/stat; returns -1 if the
+ *	process can't be inspected
+ */
+long long usps_cpu_ns(pid_t pid);
+
+/*
+ *	usps_ctxsw - voluntary and involuntary context switches made so far
+ *	by `pid', from /proc/<pid>/status
+ *
+ *	a voluntary switch means the process blocked (or stopped), an
+ *	involuntary one that the kernel preempted it; returns -1 if the
+ *	process can't be inspected
+ */
+int usps_ctxsw(pid_t pid, long *voluntary, long *involuntary);
+
+/*
+ *	usps_rss - resident set size of `pid' in bytes, from /proc/<pid>/statm
+ *
+ *	returns -1 if the process can't be inspected
+ */
+long long usps_rss(pid_t pid);
+
+/*
+ *	usps_pressure_us - total time for which some task has been stalled
+ *	waiting on `resource' ("memory", "io" or "cpu"), in microseconds,
+ *	from /proc/pressure
+ *
+ *	the growth between two readings over the time between them is the
+ *	share of that time spent under pressure; returns -1 if the kernel
+ *	doesn't keep pressure stall information
+ */
+long long usps_pressure_us(char *resource);
+
+/*
+ *	usps_parse_msec - convert milliseconds, with an optional decimal
+ *	fraction ("20", "0.25"), to nanoseconds
+ *
+ *	returns -1 if the string is not a positive number
+ */
+long long usps_parse_msec(char *s);
+
+/*
+ *	running min/max/mean/stddev over a series of nanosecond samples
+ */
+typedef struct uspsstat {
+    long n;
+    long long min, max;
+    double sum, sumsq;
+} UspsStat;
+
+void usps_stat_init(UspsStat *st);
+void usps_stat_add(UspsStat *st, long long sample);
+
+/*
+ *	usps_stat_print - one line summary of `st' in microseconds on fd
+ */
+void usps_stat_print(int fd, char *label, UspsStat *st);
+
+/*
+ *	log-linear histogram of nanosecond samples: four buckets per power
+ *	of two, in an array of `n' counts kept by the caller
+ *
+ *	usps_hist_percentile returns the middle of the bucket holding the
+ *	p'th percentile (0 < p <= 100), or -1 if there are no samples
+ */
+int usps_hist_bucket(long long ns);
+long long usps_hist_percentile(long *hist, int n, double p);
+
+#endif	/* _USPS_H_ */
@@ -0,0 +1,222 @@
+/*
+ * Assignment: CIS 415 Project 1
+ *
+ * uspstop - live view of a uspsv4 run started with --metrics.
+ *
+ * Maps the scheduler's /usps-<pid> segment read-only and redraws every
+ * -interval msec: the slots and their queues, dispatch latency
+ * percentiles, and the jobs, running ones first. Each redraw copies the
+ * segment under its sequence lock (see metrics.h), retrying if the
+ * scheduler was writing, so it never shows a half-made update and never
+ * holds the scheduler up. The segment grows as jobs are streamed in, and
+ * is mapped again whenever it has. It exits once the run is over.
+ *
+ * usage: uspstop [-interval=msec] [-rows=N] [-once] pid
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include "p1fxns.h"
+#include "usps.h"
+#include "metrics.h"
+
+#define USAGE "usage: uspstop [-interval=msec] [-rows=N] [-once] pid\n"
+#define TRIES 1000
+#define BACKOFF_NS 1000000      /* nap between rounds of TRIES attempts */
+
+static char *states[] = { "ready", "run", "exited", "pending", "skipped",
+                           "parked" };
+
+// Order jobs are listed in: running, then waiting, then parked, then the rest
+static int rank[] = { 1, 0, 4, 3, 5, 2 };
+
+static int snapshot(UspsMetrics *m, UspsMetrics *copy, int size, int pid);
+static void render(UspsMetrics *m, int pid, int rows);
+
+// Main program
+int main(int argc, char *argv[]){
+    long long interval_ns = 1000000000LL;
+    int pid = 0, rows = 20, once = 0, fd, size, i;
+    char name[32], num[16];
+    UspsMetrics *m, *copy;
+    struct timespec nap;
+
+    // Check for arguments
+    for (i = 1; i < argc; i++){
+        if (p1strneq(argv[i], "-interval=", 10)){
+            interval_ns = usps_parse_msec(argv[i] + 10);
+        } else if (p1strneq(argv[i], "-rows=", 6)){
+            rows = p1atoi(argv[i] + 6);
+        } else if (p1strneq(argv[i], "-once", 6)){
+            once = 1;
+        } else if (argv[i][0] == '-'){
+            p1putstr(2, USAGE);
+            exit(EXIT_FAILURE);
+        } else {
+            pid = p1atoi(argv[i]);
+        }
+    }
+    if (pid <= 0 || interval_ns <= 0 || rows < 0){
+        p1putstr(2, USAGE);
+        exit(EXIT_FAILURE);
+    }
+
+    // Map the header first to learn how big the whole segment is
+    p1strcpy(name, METRICS_PREFIX);
+    p1itoa(pid, num);
+    p1strcat(name, num);
+    if ((fd = shm_open(name, O_RDONLY, 0)) < 0){
+        p1perror(2, "No metrics for that pid (was it run with --metrics?)");
+        exit(EXIT_FAILURE);
+    }
+    m = mmap(NULL, sizeof(UspsMetrics), PROT_READ, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED){
+        p1perror(2, "Could not map metrics");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; __atomic_load_n(&m->magic, __ATOMIC_ACQUIRE) != METRICS_MAGIC; i++){
+        if (i == TRIES){
+            errno = EINVAL;
+            p1perror(2, "Metrics segment never became ready");
+            exit(EXIT_FAILURE);
+        }
+        sched_yield();
+    }
+    if (m->version != METRICS_VERSION){
+        errno = EINVAL;
+        p1perror(2, "Metrics segment is from another version of uspsv4");
+        exit(EXIT_FAILURE);
+    }
+    size = sizeof(UspsMetrics);
+    copy = NULL;
+
+    nap.tv_sec = interval_ns / 1000000000LL;
+    nap.tv_nsec = interval_ns % 1000000000LL;
+    for (;;){
+        // (Re)map the whole segment whenever it's bigger than we have
+        if (copy == NULL || copy->size > size){
+            int want = (copy == NULL) ? m->size : copy->size;
+
+            munmap(m, size);
+            m = mmap(NULL, want, PROT_READ, MAP_SHARED, fd, 0);
+            free(copy);
+            if (m == MAP_FAILED || (copy = (UspsMetrics *) malloc(want)) == NULL){
+                p1perror(2, "Could not map metrics");
+                exit(EXIT_FAILURE);
+            }
+            size = want;
+        }
+        if (snapshot(m, copy, size, pid) < 0){
+            errno = ESRCH;
+            p1perror(2, "uspsv4 exited in the middle of an update");
+            exit(EXIT_FAILURE);
+        }
+        if (copy->size > size)
+            continue;
+        render(copy, pid, rows);
+        if (once || copy->finished || (kill(pid, 0) < 0 && errno == ESRCH))
+            break;
+        nanosleep(&nap, NULL);
+    }
+
+    munmap(m, size);
+    close(fd);
+    free(copy);
+    exit(EXIT_SUCCESS);
+}
+
+// Copies the first size bytes of the segment while the scheduler isn't
+// writing it; the copy only counts if the sequence was even before and
+// unchanged after. Write windows are short, but the scheduler can be
+// descheduled inside one, so after every TRIES attempts this naps for
+// BACKOFF_NS and goes again; it only gives up if the scheduler is gone
+static int snapshot(UspsMetrics *m, UspsMetrics *copy, int size, int pid){
+    struct timespec nap = { 0, BACKOFF_NS };
+    int i;
+
+    for (i = 0; ; i++){
+        unsigned int seq = __atomic_load_n(&m->seq, __ATOMIC_ACQUIRE);
+
+        if (i > 0 && i % TRIES == 0){
+            if (kill(pid, 0) < 0 && errno == ESRCH)
+                return -1;
+            nanosleep(&nap, NULL);
+        }
+        if (seq & 1){
+            sched_yield();
+            continue;
+        }
+        memcpy(copy, (void *) m, size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&m->seq, __ATOMIC_RELAXED) == seq)
+            return 0;
+    }
+}
+
+// One screenful: the run, its slots, dispatch latency, then the jobs
+static void render(UspsMetrics *m, int pid, int rows){
+    UspsMetricsSlot *slots = METRICS_SLOTS(m);
+    UspsMetricsJob *jobs = METRICS_JOBS(m);
+    long samples = 0;
+    int i, r, shown = 0;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        samples += m->dispatch_hist[i];
+
+    dprintf(1, "\033[H\033[2J");
+    dprintf(1, "uspsv4 pid %d  policy %s  quantum %.1fms  %s %.1fs  "
+            "live %d/%d  switches %ld\n", pid, m->policy,
+            m->quantum_ns / 1e6, m->finished ? "ran" : "up",
+            m->started_ns > 0 ? (m->updated_ns - m->started_ns) / 1e9 : 0.0,
+            m->live, m->n_jobs, m->switches);
+    if (samples > 0){
+        dprintf(1, "dispatch latency  p50 %.1fus  p90 %.1fus  p99 %.1fus  "
+                "max %.1fus  (%ld switches)\n",
+                usps_hist_percentile(m->dispatch_hist, HIST_BUCKETS, 50) / 1e3,
+                usps_hist_percentile(m->dispatch_hist, HIST_BUCKETS, 90) / 1e3,
+                usps_hist_percentile(m->dispatch_hist, HIST_BUCKETS, 99) / 1e3,
+                usps_hist_percentile(m->dispatch_hist, HIST_BUCKETS, 100) / 1e3,
+                samples);
+    } else {
+        dprintf(1, "dispatch latency  no switches yet\n");
+    }
+
+    dprintf(1, "\n%4s %4s %6s %8s %9s\n", "SLOT", "CPU", "JOB", "WAITING",
+            "SWITCHES");
+    for (i = 0; i < m->n_slots; i++){
+        dprintf(1, "%4d %4d ", i, slots[i].cpu);
+        if (slots[i].current >= 0)
+            dprintf(1, "%6d", slots[i].current);
+        else
+            dprintf(1, "%6s", "-");
+        dprintf(1, " %8d %9ld\n", slots[i].waiting, slots[i].switches);
+    }
+
+    dprintf(1, "\n%6s %7s %-8s %4s %7s %9s %9s %9s  %s\n", "JOB", "PID",
+            "STATE", "SLOT", "SLICES", "CPU ms", "RUN ms", "WAIT ms",
+            "COMMAND");
+    for (r = 0; r < 6; r++){
+        for (i = 0; i < m->n_jobs && shown < rows; i++){
+            UspsMetricsJob *mj = &jobs[i];
+
+            if (mj->state < 0 || mj->state > JOB_PARKED
+                || rank[mj->state] != r)
+                continue;
+            dprintf(1, "%6d %7d %-8s %4d %7d %9.1f %9.1f %9.1f  %.*s\n", i,
+                    mj->pid, states[mj->state], mj->slot, mj->slices,
+                    mj->cpu_ns / 1e6, mj->run_ns / 1e6, mj->wait_ns / 1e6,
+                    (int) sizeof(mj->name), mj->name);
+            shown++;
+        }
+    }
+    if (shown < m->n_jobs)
+        dprintf(1, "%6s (%d more)\n", "...", m->n_jobs - shown);
+}
@@ -0,0 +1,336 @@
+/*
+ * Assignment: CIS 415 Project 1
+ *
+ * uspstrace - offline analysis of a uspsv4 --trace file.
+ *
+ * Replays the trace's events to rebuild each job's timeline: when it was
+ * launched, first ran and exited, and how long it spent waiting on a run
+ * queue, running and parked, with how many times it was dispatched and
+ * moved between slots. Prints those, then how busy each slot was. With
+ * -chrome=FILE it also writes every interval as Chrome trace-event JSON,
+ * which chrome://tracing and Perfetto display as a timeline: one lane per
+ * slot showing which job held it, and one per job showing what it was
+ * doing.
+ *
+ * usage: uspstrace [-chrome=FILE] [-rows=N] tracefile
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include "p1fxns.h"
+#include "usps.h"
+#include "trace.h"
+
+#define USAGE "usage: uspstrace [-chrome=FILE] [-rows=N] tracefile\n"
+#define CHUNK 4096
+
+// What the analysis knows of one job, replayed from its events
+typedef struct timeline {
+    int pid;
+    int state;              // JOB_ state since `since', -1 until launched
+    int slot;               // where it's queued or running
+    int level;
+    long long since;
+    long long spawned_ns, first_ns, exited_ns;
+    long long wait_ns, run_ns, parked_ns;
+    int dispatches, migrations;
+    int status;
+} Timeline;
+
+static Timeline *timelines;
+static int n_timelines;
+static long long *slot_busy;
+static int n_slots;
+static UspsTraceHeader header;
+static int chrome = -1;         // -chrome=FILE, -1 if not wanted
+static int chrome_events;
+
+static Timeline *timeline(int job);
+static void replay(UspsTraceRecord *r);
+static void interval(int job, Timeline *t, long long end);
+static void chrome_begin(void);
+static void chrome_end(void);
+static void report(long events, long long last_ns, int rows);
+
+// Main program
+int main(int argc, char *argv[]){
+    static UspsTraceRecord chunk[CHUNK];
+    char *chrome_path = NULL;
+    int fd = -1, rows = -1, i, n, k;
+    long events = 0;
+    long long last_ns = 0;
+
+    // Check for arguments
+    for (i = 1; i < argc; i++){
+        if (p1strneq(argv[i], "-chrome=", 8) && argv[i][8] != '\0'){
+            chrome_path = argv[i] + 8;
+        } else if (p1strneq(argv[i], "-rows=", 6)){
+            rows = p1atoi(argv[i] + 6);
+        } else if (argv[i][0] == '-' || fd >= 0){
+            p1putstr(2, USAGE);
+            exit(EXIT_FAILURE);
+        } else if ((fd = open(argv[i], O_RDONLY)) < 0){
+            p1perror(2, "Could not open specified file");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (fd < 0){
+        p1putstr(2, USAGE);
+        exit(EXIT_FAILURE);
+    }
+
+    if (read(fd, &header, sizeof(header)) != sizeof(header)
+        || header.magic != TRACE_MAGIC){
+        errno = EINVAL;
+        p1perror(2, "Not a uspsv4 trace");
+        exit(EXIT_FAILURE);
+    }
+    if (header.version != TRACE_VERSION
+        || header.record_size != sizeof(UspsTraceRecord)){
+        errno = EINVAL;
+        p1perror(2, "Trace is from another version of uspsv4");
+        exit(EXIT_FAILURE);
+    }
+    n_slots = (header.n_slots > 0) ? header.n_slots : 1;
+    if ((slot_busy = (long long *) calloc(n_slots, sizeof(long long))) == NULL){
+        p1perror(2, "Could not allocate slots");
+        exit(EXIT_FAILURE);
+    }
+    if (chrome_path != NULL){
+        chrome = open(chrome_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (chrome < 0){
+            p1perror(2, "Could not create Chrome trace");
+            exit(EXIT_FAILURE);
+        }
+        chrome_begin();
+    }
+
+    // A trace cut short has no count in its header, so read to the end
+    // either way; a record left half-written at the end is ignored
+    while ((n = read(fd, chunk, sizeof(chunk))) > 0){
+        n /= sizeof(UspsTraceRecord);
+        for (k = 0; k < n; k++){
+            if (chunk[k].job < 0 || chunk[k].type >= TRACE_TYPES)
+                continue;
+            replay(&chunk[k]);
+            last_ns = chunk[k].ns;
+        }
+        events += n;
+    }
+    close(fd);
+
+    // Jobs still going when the trace ends are counted up to its last event
+    for (i = 0; i < n_timelines; i++)
+        interval(i, &timelines[i], last_ns);
+
+    if (chrome >= 0){
+        chrome_end();
+        close(chrome);
+    }
+    report(events, last_ns, rows);
+    free(timelines);
+    free(slot_busy);
+    exit(EXIT_SUCCESS);
+}
+
+// The job's timeline, making room for it the first time it's seen
+static Timeline *timeline(int job){
+    if (job >= n_timelines){
+        int size = (n_timelines > 0) ? n_timelines : 64, i;
+        Timeline *t;
+
+        while (size <= job)
+            size *= 2;
+        if ((t = (Timeline *) realloc(timelines, size * sizeof(Timeline))) == NULL){
+            p1perror(2, "Could not allocate timelines");
+            exit(EXIT_FAILURE);
+        }
+        for (i = n_timelines; i < size; i++){
+            t[i].pid = 0;
+            t[i].state = -1;
+            t[i].slot = t[i].level = 0;
+            t[i].since = t[i].spawned_ns = t[i].first_ns = t[i].exited_ns = 0;
+            t[i].wait_ns = t[i].run_ns = t[i].parked_ns = 0;
+            t[i].dispatches = t[i].migrations = 0;
+            t[i].status = 0;
+        }
+        timelines = t;
+        n_timelines = size;
+    }
+    return &timelines[job];
+}
+
+// Closes the job's current interval at `end', charging it to whatever the
+// job was doing, and writes it out for Chrome
+static void interval(int job, Timeline *t, long long end){
+    long long length = end - t->since;
+    char *what;
+
+    if (t->state < 0 || t->state == JOB_EXITED || length <= 0)
+        return;
+    if (t->state == JOB_RUNNING){
+        t->run_ns += length;
+        if (t->slot >= 0 && t->slot < n_slots)
+            slot_busy[t->slot] += length;
+        what = "run";
+    } else if (t->state == JOB_PARKED){
+        t->parked_ns += length;
+        what = "parked";
+    } else {
+        t->wait_ns += length;
+        what = "wait";
+    }
+    t->since = end;
+    if (chrome < 0)
+        return;
+
+    // Timestamps are in microseconds from the start of the trace
+    dprintf(chrome, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+            "\"ts\":%.3f,\"dur\":%.3f,\"pid\":2,\"tid\":%d,"
+            "\"args\":{\"pid\":%d,\"slot\":%d,\"level\":%d}}",
+            chrome_events++ ? "," : "", what, what,
+            (end - length - header.started_ns) / 1e3, length / 1e3, job,
+            t->pid, t->slot, t->level);
+    if (t->state == JOB_RUNNING)
+        dprintf(chrome, ",\n{\"name\":\"job %d\",\"cat\":\"run\",\"ph\":\"X\","
+                "\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d,"
+                "\"args\":{\"pid\":%d,\"level\":%d}}",
+                job, (end - length - header.started_ns) / 1e3, length / 1e3,
+                t->slot, t->pid, t->level);
+}
+
+// Moves the job's timeline on by one event
+static void replay(UspsTraceRecord *r){
+    Timeline *t = timeline(r->job);
+
+    // A job given another quantum in a row just keeps running
+    if (r->type == TRACE_DISPATCH && t->state == JOB_RUNNING
+        && t->slot == r->slot){
+        t->level = r->level;
+        return;
+    }
+    interval(r->job, t, r->ns);
+    t->pid = r->pid;
+    t->since = r->ns;
+    switch (r->type){
+    case TRACE_SPAWN:
+        t->state = JOB_READY;
+        t->spawned_ns = r->ns;
+        break;
+    case TRACE_DISPATCH:
+        if (t->dispatches > 0 && t->slot != r->slot)
+            t->migrations++;
+        if (t->dispatches++ == 0)
+            t->first_ns = r->ns;
+        t->state = JOB_RUNNING;
+        break;
+    case TRACE_PREEMPT:
+    case TRACE_UNPARK:
+        t->state = JOB_READY;
+        break;
+    case TRACE_PARK:
+        t->state = JOB_PARKED;
+        break;
+    case TRACE_EXIT:
+        t->state = JOB_EXITED;
+        t->exited_ns = r->ns;
+        t->status = r->arg;
+        if (chrome >= 0)
+            dprintf(chrome, ",\n{\"name\":\"exit %d\",\"ph\":\"i\",\"s\":\"t\","
+                    "\"ts\":%.3f,\"pid\":2,\"tid\":%d}",
+                    WIFEXITED(r->arg) ? WEXITSTATUS(r->arg) : -WTERMSIG(r->arg),
+                    (r->ns - header.started_ns) / 1e3, r->job);
+        break;
+    }
+    t->slot = r->slot;
+    t->level = r->level;
+}
+
+// Opens the JSON and names the two processes and the slot lanes
+static void chrome_begin(void){
+    int i;
+
+    dprintf(chrome, "{\"displayTimeUnit\":\"ms\",\"otherData\":"
+            "{\"policy\":\"%.16s\",\"quantum_ms\":%.3f},\"traceEvents\":[\n",
+            header.policy, header.quantum_ns / 1e6);
+    dprintf(chrome, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+            "\"args\":{\"name\":\"slots\"}},\n");
+    dprintf(chrome, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":2,"
+            "\"args\":{\"name\":\"jobs\"}}");
+    for (i = 0; i < n_slots; i++)
+        dprintf(chrome, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                "\"tid\":%d,\"args\":{\"name\":\"slot %d\"}}", i, i);
+    chrome_events = 1;
+}
+
+// Names the job lanes after the jobs and closes the JSON
+static void chrome_end(void){
+    int i;
+
+    for (i = 0; i < n_timelines; i++){
+        if (timelines[i].state >= 0)
+            dprintf(chrome, ",\n{\"name\":\"thread_name\",\"ph\":\"M\","
+                    "\"pid\":2,\"tid\":%d,\"args\":{\"name\":\"job %d (pid %d)\"}}",
+                    i, i, timelines[i].pid);
+    }
+    dprintf(chrome, "\n]}\n");
+}
+
+// Prints each job's timeline, and how busy each slot was
+static void report(long events, long long last_ns, int rows){
+    long long span = last_ns - header.started_ns;
+    int i, shown = 0, n_jobs = 0;
+
+    dprintf(1, "policy %.16s quantum %.1fms slots %d: %ld events over %.1fms",
+            header.policy, header.quantum_ns / 1e6, header.n_slots, events,
+            span / 1e6);
+    if (header.records == 0 && events > 0)
+        dprintf(1, " (trace cut short)");
+    else if (header.dropped > 0)
+        dprintf(1, " (%ld dropped)", header.dropped);
+    dprintf(1, "\n\n%6s %7s %9s %9s %9s %9s %9s %9s %5s %6s\n", "JOB", "PID",
+            "LAUNCH ms", "FIRST ms", "EXIT ms", "WAIT ms", "RUN ms",
+            "PARKED ms", "DISP", "STATUS");
+    for (i = 0; i < n_timelines; i++){
+        Timeline *t = &timelines[i];
+
+        if (t->state < 0)
+            continue;
+        n_jobs++;
+        if (rows >= 0 && shown >= rows)
+            continue;
+        shown++;
+        dprintf(1, "%6d %7d %9.1f ", i, t->pid,
+                (t->spawned_ns - header.started_ns) / 1e6);
+        if (t->dispatches > 0)
+            dprintf(1, "%9.1f ", (t->first_ns - header.started_ns) / 1e6);
+        else
+            dprintf(1, "%9s ", "-");
+        if (t->state == JOB_EXITED)
+            dprintf(1, "%9.1f ", (t->exited_ns - header.started_ns) / 1e6);
+        else
+            dprintf(1, "%9s ", "-");
+        dprintf(1, "%9.1f %9.1f %9.1f %5d ", t->wait_ns / 1e6,
+                t->run_ns / 1e6, t->parked_ns / 1e6, t->dispatches);
+        if (t->state != JOB_EXITED)
+            dprintf(1, "%6s", "-");
+        else if (WIFEXITED(t->status))
+            dprintf(1, "%6d", WEXITSTATUS(t->status));
+        else
+            dprintf(1, "%3s%3d", "sig", WTERMSIG(t->status));
+        if (t->migrations > 0)
+            dprintf(1, "  (%d migrations)", t->migrations);
+        dprintf(1, "\n");
+    }
+    if (shown < n_jobs)
+        dprintf(1, "%6s (%d more)\n", "...", n_jobs - shown);
+
+    dprintf(1, "\n");
+    for (i = 0; i < n_slots; i++)
+        dprintf(1, "slot %d busy %.1f%%\n", i,
+                span > 0 ? 100.0 * slot_busy[i] / span : 0.0);
+}
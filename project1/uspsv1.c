@@ -19,18 +19,12 @@
 #include <errno.h>
 #include "p1fxns.h"
 
-// Globals
-const int BUFFER_SIZE = 512;
-
-// Forward declarations
-char **split(char *);
-
 // Main program
 int main(int argc, char *argv[]){
     int i;
     int fd;
     int n = 0;
-    char **lines;
+    P1Workload *workload;
 
     if (argc == 1){
         errno = EINVAL;
@@ -40,27 +34,16 @@ int main(int argc, char *argv[]){
 
     // Open the workload file and read out the lines
     if ((fd = open(argv[argc - 1], O_RDONLY)) >= 0) {
-        // File opened successfully
-        char buffer[BUFFER_SIZE];
-
-        // Get the number of lines in the file
-        while(p1getline(fd, buffer, BUFFER_SIZE) > 0){
-            n++;
-        }
-        
-        // Malloc for the lines array
-        lines = (char **) malloc(sizeof(char *) * n);
-
-        // Return to the start of the file
-        lseek(fd, 0, SEEK_SET);
+        // File opened successfully, so read every line in and split it
+        // into words once, here in the parent
+        P1Reader *reader = p1reader_create(fd);
 
-        // Read the file into the lines array
-        int bytes_read;
-        for (i = 0; i < n; i++){
-            bytes_read = p1getline(fd, buffer, BUFFER_SIZE);
-            lines[i] = (char *) malloc(bytes_read + 1);
-            p1strcpy(lines[i], buffer);
+        if (reader == NULL || (workload = p1workload_read(reader, -1)) == NULL){
+            p1perror(2, "Could not read the workload text");
+            exit(EXIT_FAILURE);
         }
+        p1reader_destroy(reader);
+        n = workload->count;
 
         // Done with the file, so close it.
         close(fd);
@@ -71,8 +54,7 @@ int main(int argc, char *argv[]){
         exit(EXIT_FAILURE);
     }
 
-    // Fork each line into a new process, freeing each line
-    // as it goes
+    // Fork each line into a new process
     pid_t pid[n];
     for (i = 0; i < n; i++){
         // Fork the proces
@@ -80,11 +62,13 @@ int main(int argc, char *argv[]){
 
         // Check if the running process is the child
         if (pid[i] == 0){
-            // Split the line into words
-            char **words = split(lines[i]);
+            // Execute the command from the line's words
+            char **words = workload->argv[i];
 
-            // Execute the command from the words
-            execvp(words[0], words);
+            if (words[0] != NULL)
+                execvp(words[0], words);
+            else
+                errno = EINVAL;
 
             // If we returned here, then starting the process failed
             p1perror(2, "Could not execute command");
@@ -94,13 +78,10 @@ int main(int argc, char *argv[]){
             p1perror(2, "Could not fork");
             exit(EXIT_FAILURE);
         }
-
-        // Free this line while we're here
-        free(lines[i]);
     }
 
-    // Free the lines array itself
-    free(lines);
+    // Every child has its own copy now, so free the workload
+    p1workload_destroy(workload);
 
     // Wait for child processes to finish
     int signal;
@@ -112,42 +93,3 @@ int main(int argc, char *argv[]){
     // Exit successfully.
     exit(EXIT_SUCCESS);
 }
-
-// Returns the contents of the line split by non-quoted whitespace,
-// terminated with a NULL
-char **split(char *line){
-    // Find out how many words we're working with
-    int i = 0, word_count = 0;
-    char temp[BUFFER_SIZE];
-    char **words;
-
-    while (i >= 0){
-        word_count++;
-        i = p1getword(line, i, temp);
-    }
-
-    // Set up the 2D array for the words
-    words = (char **) malloc(sizeof(char *) * (word_count + 1));
-    int b_index = 0;
-    for (i = 0; i < word_count; i++){
-        // Read in word to excessively sized string
-        char *w = (char *) malloc(BUFFER_SIZE);
-        b_index = p1getword(line, b_index, w);
-
-        // Get length, and prune newlines with it
-        int wlen = p1strlen(w);
-        if (w[wlen - 1] == '\n'){
-            w[wlen - 1] = '\0';
-            wlen--;
-        }
-        
-        // Shrink allocated memory to what we actually need
-        w = (char *) realloc(w, wlen);
-        words[i] = w;
-    }
-
-    // Null-terminate it
-    words[word_count] = NULL;
-
-    return words;
-}
@@ -22,19 +22,15 @@
 #include "p1fxns.h"
 
 // Globals EVERYWHERE I'M SO SICK OF RACE CONDITIONS HOLY SHIT
-#define BUFFER_SIZE 512
 #define UNUSED __attribute__((unused))
 #define SEM_NAME "mutex"
 int n = 0;
 int ready = 0;
-char **lines;
+P1Workload *workload;
 int line_index;
 pid_t parent_pid;
 int i;   // Throwaway for loops
 
-// Forward declarations
-char **split(char *);
-
 // Signal handlers
 void onusr1(UNUSED int);
 
@@ -53,27 +49,16 @@ int main(int argc, char *argv[]){
 
     // Open the workload file and read out the lines
     if ((fd = open(argv[argc - 1], O_RDONLY)) >= 0) {
-        // File opened successfully
-        char buffer[BUFFER_SIZE];
+        // File opened successfully, so read every line in and split it
+        // into words once, here in the parent
+        P1Reader *reader = p1reader_create(fd);
 
-        // Get the number of lines in the file
-        while(p1getline(fd, buffer, BUFFER_SIZE) > 0){
-            n++;
-        }
-        
-        // Malloc for the lines array
-        lines = (char **) malloc(sizeof(char *) * n);
-
-        // Return to the start of the file
-        lseek(fd, 0, SEEK_SET);
-
-        // Read the file into the lines array
-        int bytes_read;
-        for (i = 0; i < n; i++){
-            bytes_read = p1getline(fd, buffer, BUFFER_SIZE);
-            lines[i] = (char *) malloc(bytes_read + 1);
-            p1strcpy(lines[i], buffer);
+        if (reader == NULL || (workload = p1workload_read(reader, -1)) == NULL){
+            p1perror(2, "Could not read the workload text");
+            exit(EXIT_FAILURE);
         }
+        p1reader_destroy(reader);
+        n = workload->count;
 
         // Done with the file, so close it.
         close(fd);
@@ -141,65 +126,26 @@ int main(int argc, char *argv[]){
         n--;
     }
 
-    // Free the lines array
-    for (i = 0; i < n; i++){
-        free(lines[i]);
-    }
-    free(lines);
+    // Free the workload
+    p1workload_destroy(workload);
 
     // Exit successfully.
     exit(EXIT_SUCCESS);
 }
 
-// Returns the contents of the line split by non-quoted whitespace,
-// terminated with a NULL
-char **split(char *line){
-    // Find out how many words we're working with
-    int i = 0, word_count = 0;
-    char temp[BUFFER_SIZE];
-    char **words;
-
-    while (i >= 0){
-        word_count++;
-        i = p1getword(line, i, temp);
-    }
-
-    // Set up the 2D array for the words
-    words = (char **) malloc(sizeof(char *) * (word_count + 1));
-    int b_index = 0;
-    for (i = 0; i < word_count; i++){
-        // Read in word to excessively sized string
-        char *w = (char *) malloc(BUFFER_SIZE);
-        b_index = p1getword(line, b_index, w);
-
-        // Get length, and prune newlines with it
-        int wlen = p1strlen(w);
-        if (w[wlen - 1] == '\n'){
-            w[wlen - 1] = '\0';
-            wlen--;
-        }
-        
-        // Shrink allocated memory to what we actually need
-        w = (char *) realloc(w, wlen);
-        words[i] = w;
-    }
-
-    // Null-terminate it
-    words[word_count] = NULL;
-
-    return words;
-}
-
 // Signal handler for the SIGUSR1
 void onusr1(UNUSED int signal){
     if (getpid() == parent_pid){
         ready++;
     } else if (getppid() == parent_pid) {
-        // Split the line into words
-        char **words = split(lines[line_index]);
-
-        // Execute the command from the words
-        execvp(words[0], words);
+        // Execute the command from the line's words, split up front
+        // by the parent
+        char **words = workload->argv[line_index];
+
+        if (words[0] != NULL)
+            execvp(words[0], words);
+        else
+            errno = EINVAL;
 
         // If we returned here, then starting the process failed
         p1perror(2, "Could not execute command");
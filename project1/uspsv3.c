@@ -25,19 +25,15 @@
 
 // Globals EVERYWHERE so they can be used in signal handlers because
 // I'm bad at programming
-#define BUFFER_SIZE 512
 #define UNUSED __attribute__((unused))
 int n = 0;
 volatile int ready = 0;
-char **lines;
+P1Workload *workload;
 int p_line;
 pid_t parent_pid;
 pid_t *children;
 int i;   // Throwaway for loops
 
-// Forward declarations
-char **split(char *);
-
 // Signal handlers
 void onusr1(UNUSED int);
 void onalrm(UNUSED int);
@@ -83,29 +79,23 @@ int main(int argc, char *argv[]){
     }
 
     // !!! PARENT PROCESS - STARTUP !!!
-    char buffer[BUFFER_SIZE];
+    P1Reader *reader = p1reader_create(fd);
+    int limit = -1, bytes_read;
+    char *line;
 
-    // Get the number of lines in the file
-    if (fd != 0){
-        while(p1getline(fd, buffer, BUFFER_SIZE) > 0){
-            n++;
-        }
-        lseek(fd, 0, SEEK_SET);
-    } else {
-        p1getline(fd, buffer, BUFFER_SIZE);
-        n = p1atoi(buffer);
+    // On stdin the first line says how many lines follow
+    if (reader != NULL && fd == 0
+            && (line = p1reader_line(reader, &bytes_read)) != NULL){
+        limit = p1atoi(line);
     }
-        
-    // Malloc for the lines array
-    lines = (char **) malloc(sizeof(char *) * n);
 
-    // Read the file into the lines array
-    int bytes_read;
-    for (i = 0; i < n; i++){
-        bytes_read = p1getline(fd, buffer, BUFFER_SIZE);
-        lines[i] = (char *) malloc(bytes_read + 1); // for '/0'
-        p1strcpy(lines[i], buffer);
+    // Read every line in and split it into words once, here in the parent
+    if (reader == NULL || (workload = p1workload_read(reader, limit)) == NULL){
+        p1perror(2, "Could not read the workload");
+        exit(EXIT_FAILURE);
     }
+    p1reader_destroy(reader);
+    n = workload->count;
 
     // Done with the file, so close it if not stdin
     if (fd != 0)
@@ -183,13 +173,10 @@ int main(int argc, char *argv[]){
     rr_timer.it_value.tv_usec = 0;
     setitimer(ITIMER_REAL, &rr_timer, NULL);
 
-    printf("Freeing lines\n");
+    printf("Freeing workload\n");
 
-    // Free the lines array
-    for (i = 0; i < n; i++){
-        free(lines[i]);
-    }
-    free(lines);
+    // Free the workload
+    p1workload_destroy(workload);
 
     // Free the children!
     free(children);
@@ -198,55 +185,19 @@ int main(int argc, char *argv[]){
     exit(EXIT_SUCCESS);
 }
 
-// Returns the contents of the line split by non-quoted whitespace,
-// terminated with a NULL
-char **split(char *line){
-    // Find out how many words we're working with
-    int i = 0, word_count = 0;
-    char temp[BUFFER_SIZE];
-    char **words;
-
-    while (i >= 0){
-        word_count++;
-        i = p1getword(line, i, temp);
-    }
-
-    // Set up the 2D array for the words
-    words = (char **) malloc(sizeof(char *) * (word_count + 1));
-    int b_index = 0;
-    for (i = 0; i < word_count; i++){
-        // Read in word to excessively sized string
-        char *w = (char *) malloc(BUFFER_SIZE);
-        b_index = p1getword(line, b_index, w);
-
-        // Get length, and prune newlines with it
-        int wlen = p1strlen(w);
-        if (w[wlen - 1] == '\n'){
-            w[wlen - 1] = '\0';
-            wlen--;
-        }
-        
-        // Shrink allocated memory to what we actually need
-        w = (char *) realloc(w, wlen);
-        words[i] = w;
-    }
-
-    // Null-terminate it
-    words[word_count] = NULL;
-
-    return words;
-}
-
 // Signal handler for the SIGUSR1
 void onusr1(UNUSED int signal){
     if (getpid() == parent_pid){
         ready++;
     } else if (getppid() == parent_pid) {
-        // Split the line into words
-        char **words = split(lines[p_line]);
+        // Execute the command from the line's words, split up front
+        // by the parent
+        char **words = workload->argv[p_line];
 
-        // Execute the command from the words
-        execvp(words[0], words);
+        if (words[0] != NULL)
+            execvp(words[0], words);
+        else
+            errno = EINVAL;
 
         // If we returned here, then starting the process failed
         p1perror(2, "Could not execute command");
@@ -0,0 +1,2231 @@
+/*
+ * Assignment: CIS 415 Project 1
+ *
+ * USPSv4 - round-robin scheduler driven by a single epoll loop.
+ *
+ * Unlike uspsv3, nothing is done in signal handlers. SIGCHLD is blocked
+ * and read through a signalfd, quanta are timed with an absolute
+ * CLOCK_MONOTONIC timerfd (nanosecond resolution, no tv_usec overflow),
+ * and children are launched stopped without any handshake (see below).
+ * Every timer wakeup records how late it fired (jitter) and how long
+ * the switch to the next job took (dispatch overhead).
+ *
+ * With --cpus=N up to N jobs run at once, one per slot. Each slot is
+ * pinned to a core, has its own quantum timer and its own round-robin
+ * queue; a job only migrates when a slot runs dry and takes work from
+ * the longest queue elsewhere.
+ *
+ * Policies plug into the engine, which launches, stops, continues and
+ * reaps jobs, times the quanta and keeps the run queues, through a small
+ * table of hooks (see Policy below): where a job waits, which one runs
+ * next, and what to make of a slice it used up, of one it spent blocked
+ * and of its exit. The engine measures each slice from /proc for the
+ * policies that ask, so all of them are selected at run time and can be
+ * compared on the same workload.
+ *
+ * -policy=fifo runs jobs to completion in the order they were launched,
+ * one per slot; the quantum timer still fires, but nobody is preempted.
+ *
+ * -policy=mlfq replaces plain round-robin with a multi-level feedback
+ * queue. The quantum doubles at each level down; a job whose CPU time
+ * over a slice (from /proc) shows it used most of the quantum is demoted,
+ * one that spent most of it blocked is promoted, and every -boost=msec
+ * all jobs go back to the top level so CPU-bound jobs can't starve.
+ *
+ * -policy=adaptive keeps one round-robin queue but sizes every job's
+ * quantum from its own behaviour, read from /proc after each slice: CPU
+ * time used, voluntary switches (it blocked) and involuntary ones (it was
+ * preempted). Jobs that block get a quantum just long enough for their
+ * usual run between blocks; CPU-bound jobs get longer and longer quanta
+ * so they're stopped and continued less often.
+ *
+ * -policy=stride gives jobs CPU in proportion to a share=N annotation
+ * in front of their line (1 if there's none; other policies just drop
+ * it). Each job's pass advances by STRIDE1/N for every quantum's worth of
+ * CPU time it was measured to use, not for the quantum it was given, and
+ * the job with the smallest pass runs next. A job starts one stride past
+ * the virtual time, which advances by STRIDE1 over the shares of every
+ * job in rotation, so one launched late doesn't hold the CPU until it
+ * has caught up with the others.
+ *
+ * Jobs can depend on each other, in the manner of make: id=NAME names a
+ * job and after=NAME,NAME... holds it back until those jobs have exited.
+ * A job is only launched once everything it's after has exited
+ * successfully (if one fails, it and everything after it are skipped),
+ * and --jobs=N caps how many are launched at once. The report ends with
+ * the critical path, the longest chain of dependent jobs.
+ *
+ * --listen=PATH keeps the scheduler running to take more jobs, one per
+ * line in the workload's format, while it works through the ones it has.
+ * If PATH is a FIFO it's read directly (opened for writing too, so it
+ * never reaches end of file when a writer goes away); otherwise a Unix
+ * stream socket is created there and any number of clients can connect
+ * and send lines. A job is admitted the moment its line arrives, and its
+ * after= names can be any job before it. With --jobs=N the stream never
+ * has more than N jobs launched at once however fast it arrives; the
+ * rest wait their turn unforked. SIGINT or SIGTERM stops the listening,
+ * and the scheduler exits once the jobs it has taken in are done.
+ *
+ * --output=DIR captures each job's output rather than letting it go to
+ * the terminal mixed up with everyone else's: the job's stdout and stderr
+ * are a pipe, which the event loop drains into DIR/job-N.out with splice,
+ * without copying it through the scheduler. The pipe is only read when
+ * it has something in it, so a job that writes a lot never holds up the
+ * scheduler, and nothing the scheduler does waits on whoever reads the
+ * files. Each job's pipe is made large so it rarely has to wait either.
+ *
+ * --pressure=PCT keeps memory-hungry workloads from thrashing. Every
+ * PRESSURE_MSEC it works out, from /proc/pressure/memory, the share of
+ * that time some task spent stalled waiting for memory. At PCT percent or
+ * more, the number of jobs in rotation is halved (down to one per slot)
+ * by parking the ones with the largest resident sets: they stay stopped,
+ * off the run queues, so their pages can be reclaimed and stay reclaimed.
+ * Under half of PCT, one more job is let back in each period, the longest
+ * parked first, then new ones. Throughput falls off gradually as memory
+ * runs short instead of collapsing when every job's pages are needed
+ * every round.
+ *
+ * --trace=FILE records every scheduling event (launch, dispatch, preempt,
+ * exit, and parking) with its CLOCK_MONOTONIC time as a fixed-size binary
+ * record; the event loop only stores it into a buffer, and full buffers
+ * are written out by a thread of its own (see trace.h). uspstrace turns
+ * the file into per-job timelines and Chrome trace-event JSON.
+ *
+ * --metrics publishes live per-job and per-slot state, and a histogram
+ * of dispatch latency, in shared memory as /usps-<pid> for uspstop to
+ * watch. Updates are plain stores under a sequence lock (see metrics.h),
+ * so watching a run doesn't slow it down.
+ *
+ * Jobs are launched one of two ways. -launch=fork (the default) forks,
+ * and the child waits on a barrier (a futex in a shared page) until every
+ * job is launched; the parent stops it right after fork, so when the
+ * barrier opens it is already stopped and only execs once it's first
+ * dispatched. A pipe won't do as the barrier: a child stopped before it
+ * could close its copy of the write end would hold everyone's EOF back.
+ * -launch=spawn uses posix_spawn, which shares the parent's memory
+ * rather than copying page tables, and stops the job straight after exec,
+ * so a job may run for a few microseconds before its first dispatch.
+ * Either way the words of each line are split once, in the parent, in
+ * place in a single allocation holding the whole workload, and the
+ * launch rate is reported in jobs/sec.
+ *
+ * usage: uspsv4 [-quantum=msec] [--cpus=N] [--jobs=N] [--metrics]
+ *               [--listen=PATH] [--output=DIR] [--pressure=PCT]
+ *               [--trace=FILE] [-policy=rr|fifo|mlfq|adaptive|stride]
+ *               [-boost=msec] [-launch=fork|spawn] [workload_file]
+ */
+
+#define _GNU_SOURCE     // For sched_setaffinity and CPU_SET
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <spawn.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "p1fxns.h"
+#include "usps.h"
+#include "metrics.h"
+#include "trace.h"
+
+#define MAX_EVENTS 8
+#define USAGE "usage: uspsv4 [-quantum=msec] [--cpus=N] [--jobs=N] [--metrics] " \
+              "[--listen=PATH] [--output=DIR] [--pressure=PCT] " \
+              "[--trace=FILE] [-policy=rr|fifo|mlfq|adaptive|stride] " \
+              "[-boost=msec] [-launch=fork|spawn] [workload_file]\n"
+
+// Ways of launching jobs
+#define LAUNCH_FORK  0
+#define LAUNCH_SPAWN 1
+
+// Feedback queue levels, and the default period between priority boosts
+#define LEVELS 4
+#define BOOST_MSEC "1000"
+
+// Bounds on an adaptive quantum, as fractions and multiples of -quantum
+#define ADAPT_MIN_SHIFT 2
+#define ADAPT_MAX_SHIFT 2
+
+// A job's stride is STRIDE1 over its share; its pass advances by its
+// stride for every quantum's worth of CPU time it actually uses
+#define STRIDE1 (1 << 20)
+
+// What an epoll event came from; slot timers are EV_SLOT + slot index,
+// --listen connections (or the FIFO) EV_SOURCE + source index and the
+// pipes of jobs whose output is captured EV_OUTPUT + job index
+#define EV_CHILD    0
+#define EV_BOOST    1
+#define EV_LISTEN   2
+#define EV_PRESSURE 3
+#define EV_SLOT     4
+#define EV_SOURCE 0x10000
+#define EV_OUTPUT 0x80000000u
+
+// How often memory pressure is sampled under --pressure
+#define PRESSURE_MSEC 250
+
+// Size asked for each --output pipe, and the most moved per splice
+#define OUTPUT_PIPE_SIZE (1 << 20)
+
+// One CPU slot: a core, the job running on it and the jobs waiting, one
+// queue per feedback level (round-robin only uses the first)
+typedef struct slot {
+    int index;
+    int cpu;
+    int tfd;
+    Job *current;
+    RunQueue rq[LEVELS];
+    int waiting;
+    long long deadline_ns;
+
+    long long busy_ns;      // time a job has held the slot
+    long long since_ns;     // when the current job was dispatched
+    long switches;
+} Slot;
+
+// What a job did with its slice, measured by the engine from /proc
+typedef struct sliceuse {
+    long long used;         // CPU time
+    long blocks;            // voluntary context switches: times it blocked
+    long preempts;          // involuntary ones: times the kernel preempted it
+} SliceUse;
+
+// What a policy wants measured over each slice
+#define MEASURE_CPU      1
+#define MEASURE_SWITCHES 2
+
+// A scheduling policy: the hooks the engine calls wherever policies
+// differ. A job counts as blocked over a slice if it blocked at all when
+// switches are measured, and otherwise if it used under a quarter of the
+// slice; on_block then gets the slice rather than on_quantum_expired.
+// Hooks other than enqueue, pick_next and quantum may be NULL
+typedef struct policy {
+    char *name;
+    int measure;                                    // MEASURE_ bits, or 0
+    void (*enqueue)(Slot *slot, Job *job);          // onto the slot's queues
+    Job *(*pick_next)(Slot *slot, Job *current);    // see pick_top
+    long long (*quantum)(Job *job);
+    void (*on_quantum_expired)(Job *job, SliceUse *use);
+    void (*on_block)(Job *job, SliceUse *use);
+    void (*on_exit)(Job *job);                      // once it's reaped
+    void (*on_boost)(void);                         // every -boost=msec
+    void (*describe)(Job *job);                     // for its report line
+} Policy;
+
+// A connection, or the FIFO, that jobs are streamed in over, with
+// whatever it has sent of a line that hasn't ended yet
+typedef struct source {
+    int fd;                 // -1 if the entry is free
+    char *buf;
+    int len, size;
+} Source;
+
+// Scheduler state - only ever touched from the event loop
+static P1Workload *workload;   // every line's argv, in one allocation
+static Job *loaded;             // the workload file's jobs, in one block
+static int n_loaded;
+static Job **jobs;              // those, then any streamed in with --listen
+static int n_jobs, max_jobs;
+static int live;
+static int max_live;            // --jobs=N; 0 launches everything ready
+static Job **ids;               // open-addressed map from id to job
+static int ids_mask, n_ids;
+static Job **edges;             // every job's after and dependents lists
+static int n_edges;
+static Job **order;             // each job after everything it waits for
+static Job **ready;             // waiting only for room under --jobs
+static int ready_head, ready_tail;
+static Slot *slots;
+static int n_slots = 1;
+static int pressure_high;       // --pressure=PCT; 0 if not watching
+static int active_max = INT_MAX;   // jobs allowed in rotation, not parked
+static RunQueue parked;         // stopped and held out of rotation
+static long long pressure_us, pressure_ns;  // last reading, and when
+static PidTable *pids;
+static long long quantum_ns;
+static Policy rr_policy, fifo_policy, mlfq_policy, adaptive_policy,
+              stride_policy;
+static Policy *policy = &rr_policy;
+static long long global_pass;   // stride scheduling virtual time
+static int live_shares;         // shares of the stride jobs in rotation
+static int launcher = LAUNCH_FORK;
+static int sfd, bfd, pfd, epfd;
+static char *output_dir;        // --output=DIR
+static char *listen_path;       // --listen=PATH
+static char *trace_path;        // --trace=FILE
+static UspsTraceHeader trace_header;
+static int listening;
+static int lfd = -1;            // the socket, -1 when PATH is a FIFO
+static Source *sources;
+static int n_sources, max_sources;
+static volatile int *barrier;    // generation, shared with forked jobs
+static sigset_t childmask;
+
+// The environment handed to spawned jobs
+extern char **environ;
+
+// Live metrics for uspstop, if --metrics asked for them
+static UspsMetrics *metrics;
+static char metrics_name[32];
+static int metrics_fd, metrics_cap;     // kept to grow it for streamed jobs
+static Policy *policies[] = { &rr_policy, &fifo_policy, &mlfq_policy,
+                              &adaptive_policy, &stride_policy, NULL };
+
+// Measurements of the scheduler itself, and totals over every job
+static long switches, migrations, boosts, parks;
+static long long total_cpu_ns;
+static int total_shares;
+static long long peak_pressure;         // in tenths of a percent
+static int fewest_active = INT_MAX;
+static long long began_ns, launch_ns;
+static int launched;
+static UspsStat jitter, overhead;
+
+// Forward declarations
+static int load_workload(int fd);
+static char **parse_notes(char **words, int *share, char **id);
+static void init_job(Job *job, char **argv, int share, char *id);
+static int link_jobs(char ***notes);
+static int listen_open(void);
+static void listen_close(void);
+static void on_accept(void);
+static void on_source(Source *src);
+static int add_source(int fd);
+static void close_source(Source *src);
+static int submit(char *line);
+static void refill(void);
+static int output_open(Job *job);
+static void on_output(Job *job);
+static void output_close(Job *job);
+static int setup_slots(void);
+static int launch_begin(void);
+static int launch(Job *job);
+static Slot *emptiest(void);
+static void launch_end(void);
+static void admit(void);
+static void complete(Job *job);
+static void enqueue(Slot *slot, Job *job);
+static Job *next_job(Slot *slot);
+static void dispatch(Slot *slot, Job *job);
+static void on_quantum(Slot *slot);
+static void on_boost(void);
+static void on_pressure(void);
+static void on_child(void);
+static int metrics_open(void);
+static void metrics_begin(void);
+static void metrics_end(void);
+static void metrics_totals(void);
+static void metrics_add(Job *job);
+static void metrics_close(void);
+static void publish(Job *job);
+static void critical_path(long long wall);
+static void report(void);
+
+// Main program
+int main(int argc, char *argv[]){
+    int fd = -1;
+    int i;
+    char *value = NULL, *boost = BOOST_MSEC;
+    long long boost_ns;
+    int want_metrics = 0;
+
+    // Check for arguments
+    for (i = 1; i < argc; i++){
+        if (p1strneq(argv[i], "-quantum=", 9)){
+            value = argv[i] + 9;
+        } else if (p1strneq(argv[i], "--quantum=", 10)){
+            value = argv[i] + 10;
+        } else if (p1strneq(argv[i], "--cpus=", 7)){
+            if ((n_slots = p1atoi(argv[i] + 7)) < 1){
+                errno = EINVAL;
+                p1perror(2, "Bad value for cpus");
+                exit(EXIT_FAILURE);
+            }
+        } else if (p1strneq(argv[i], "--jobs=", 7)){
+            if ((max_live = p1atoi(argv[i] + 7)) < 1){
+                errno = EINVAL;
+                p1perror(2, "Bad value for jobs");
+                exit(EXIT_FAILURE);
+            }
+        } else if (p1strneq(argv[i], "-policy=", 8)){
+            int k;
+
+            for (k = 0; policies[k] != NULL; k++){
+                if (p1strneq(argv[i] + 8, policies[k]->name,
+                             p1strlen(policies[k]->name) + 1))
+                    break;
+            }
+            if (policies[k] == NULL){
+                errno = EINVAL;
+                p1perror(2, "Unknown policy");
+                exit(EXIT_FAILURE);
+            }
+            policy = policies[k];
+        } else if (p1strneq(argv[i], "-launch=", 8)){
+            if (p1strneq(argv[i] + 8, "fork", 5)){
+                launcher = LAUNCH_FORK;
+            } else if (p1strneq(argv[i] + 8, "spawn", 6)){
+                launcher = LAUNCH_SPAWN;
+            } else {
+                errno = EINVAL;
+                p1perror(2, "Unknown launcher");
+                exit(EXIT_FAILURE);
+            }
+        } else if (p1strneq(argv[i], "-boost=", 7)){
+            boost = argv[i] + 7;
+        } else if (p1strneq(argv[i], "--metrics", 10)){
+            want_metrics = 1;
+        } else if (p1strneq(argv[i], "--listen=", 9) && argv[i][9] != '\0'){
+            listen_path = argv[i] + 9;
+        } else if (p1strneq(argv[i], "--pressure=", 11)){
+            if ((pressure_high = p1atoi(argv[i] + 11)) < 1 || pressure_high > 100){
+                errno = EINVAL;
+                p1perror(2, "Bad value for pressure");
+                exit(EXIT_FAILURE);
+            }
+        } else if (p1strneq(argv[i], "--trace=", 8) && argv[i][8] != '\0'){
+            trace_path = argv[i] + 8;
+        } else if (p1strneq(argv[i], "--output=", 9) && argv[i][9] != '\0'){
+            output_dir = argv[i] + 9;
+            if (p1strlen(output_dir) > PATH_MAX - 32
+                || (mkdir(output_dir, 0777) < 0 && errno != EEXIST)){
+                p1perror(2, "Could not create output directory");
+                exit(EXIT_FAILURE);
+            }
+        } else if (argv[i][0] == '-'){
+            p1putstr(2, USAGE);
+            exit(EXIT_FAILURE);
+        } else if ((fd = open(argv[i], O_RDONLY)) < 0){
+            p1perror(2, "Could not open specified file");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Fall back on the environment for the quantum
+    if (value == NULL && (value = getenv("USPS_QUANTUM_MSEC")) == NULL){
+        errno = EINVAL;
+        p1perror(2, "Could not find env value for quantum");
+        exit(EXIT_FAILURE);
+    }
+    if ((quantum_ns = usps_parse_msec(value)) < 0){
+        errno = EINVAL;
+        p1perror(2, "Bad value for quantum");
+        exit(EXIT_FAILURE);
+    }
+    if ((boost_ns = usps_parse_msec(boost)) < 0){
+        errno = EINVAL;
+        p1perror(2, "Bad value for boost");
+        exit(EXIT_FAILURE);
+    }
+
+    // Read the workload in, one job per non-blank line; it's standard input
+    // unless there's a file, or jobs are to be streamed in instead
+    if (fd < 0 && listen_path == NULL)
+        fd = 0;
+    if (load_workload(fd) < 0){
+        if (errno == EINVAL)
+            p1putstr(2, "Bad share, unknown or duplicate id in workload\n");
+        else if (errno == ELOOP)
+            p1putstr(2, "Jobs in workload wait on each other in a cycle\n");
+        else
+            p1perror(2, "Could not read workload");
+        exit(EXIT_FAILURE);
+    }
+    if (fd > 0)
+        close(fd);
+
+    // SIGCHLD only ever arrives through the signalfd, and not for stops;
+    // so, when listening, do the signals that stop it
+    sigset_t mask;
+    struct sigaction sa;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (listen_path != NULL){
+        sigaddset(&mask, SIGINT);
+        sigaddset(&mask, SIGTERM);
+    }
+    sigprocmask(SIG_BLOCK, &mask, &childmask);
+    sa.sa_handler = SIG_DFL;
+    sa.sa_flags = SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+
+    sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (sfd < 0 || epfd < 0 || setup_slots() < 0){
+        p1perror(2, "Could not set up event loop");
+        exit(EXIT_FAILURE);
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = EV_CHILD;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, sfd, &ev);
+
+    // Feedback queues get a periodic boost back to the top level
+    if (policy->on_boost != NULL){
+        struct itimerspec its;
+
+        its.it_value.tv_sec = its.it_interval.tv_sec = boost_ns / 1000000000LL;
+        its.it_value.tv_nsec = its.it_interval.tv_nsec = boost_ns % 1000000000LL;
+        if ((bfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0){
+            p1perror(2, "Could not set up event loop");
+            exit(EXIT_FAILURE);
+        }
+        timerfd_settime(bfd, 0, &its, NULL);
+        ev.data.u32 = EV_BOOST;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, bfd, &ev);
+    }
+
+    // Memory pressure is sampled on a timer of its own
+    if (pressure_high > 0){
+        struct itimerspec its;
+
+        usps_rq_init(&parked);
+        if ((pressure_us = usps_pressure_us("memory")) < 0){
+            errno = ENOTSUP;
+            p1perror(2, "No memory pressure information (/proc/pressure)");
+            exit(EXIT_FAILURE);
+        }
+        pressure_ns = usps_now_ns();
+        its.it_value.tv_sec = its.it_interval.tv_sec = 0;
+        its.it_value.tv_nsec = its.it_interval.tv_nsec = PRESSURE_MSEC * 1000000L;
+        if ((pfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0){
+            p1perror(2, "Could not set up event loop");
+            exit(EXIT_FAILURE);
+        }
+        timerfd_settime(pfd, 0, &its, NULL);
+        ev.data.u32 = EV_PRESSURE;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, pfd, &ev);
+    }
+
+    if (want_metrics && metrics_open() < 0){
+        p1perror(2, "Could not create metrics segment");
+        exit(EXIT_FAILURE);
+    }
+    if (listen_path != NULL && listen_open() < 0){
+        p1perror(2, "Could not listen for jobs");
+        exit(EXIT_FAILURE);
+    }
+    if (trace_path != NULL){
+        trace_header.n_slots = n_slots;
+        p1strcpy(trace_header.policy, policy->name);
+        trace_header.quantum_ns = quantum_ns;
+        trace_header.started_ns = usps_now_ns();
+        if (usps_trace_open(trace_path, &trace_header) < 0){
+            p1perror(2, "Could not create trace");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Launch every job that waits on nothing, as many as --jobs allows;
+    // none of them runs before it's dispatched
+    if ((pids = usps_pids_create(n_jobs)) == NULL){
+        p1perror(2, "Could not allocate pid table");
+        exit(EXIT_FAILURE);
+    }
+    usps_stat_init(&jitter);
+    usps_stat_init(&overhead);
+    if (launch_begin() < 0){
+        p1perror(2, "Could not create launch barrier");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < n_jobs; i++){
+        if (jobs[i]->pending == 0)
+            ready[ready_tail++] = jobs[i];
+    }
+    admit();
+
+    // Round-robin until everything has been reaped
+    began_ns = usps_now_ns();
+    for (i = 0; i < n_slots; i++){
+        Job *job = next_job(&slots[i]);
+        if (job != NULL)
+            dispatch(&slots[i], job);
+    }
+    metrics_totals();
+    while (live > 0 || listening){
+        struct epoll_event events[MAX_EVENTS];
+        int nev = epoll_wait(epfd, events, MAX_EVENTS, -1);
+
+        if (nev < 0 && errno == EINTR)
+            continue;
+        for (i = 0; i < nev; i++){
+            if (events[i].data.u32 >= EV_OUTPUT)
+                on_output(jobs[events[i].data.u32 - EV_OUTPUT]);
+            else if (events[i].data.u32 >= EV_SOURCE)
+                on_source(&sources[events[i].data.u32 - EV_SOURCE]);
+            else if (events[i].data.u32 >= EV_SLOT)
+                on_quantum(&slots[events[i].data.u32 - EV_SLOT]);
+            else if (events[i].data.u32 == EV_LISTEN)
+                on_accept();
+            else if (events[i].data.u32 == EV_PRESSURE)
+                on_pressure();
+            else if (events[i].data.u32 == EV_BOOST)
+                on_boost();
+            else
+                on_child();
+        }
+        metrics_totals();
+    }
+
+    // Whatever jobs wrote just before exiting may still be in their pipes;
+    // anything they left running that still holds a pipe open is ignored
+    for (i = 0; i < n_jobs; i++){
+        if (jobs[i]->out_fd >= 0){
+            on_output(jobs[i]);
+            output_close(jobs[i]);
+        }
+    }
+
+    if (trace_path != NULL && usps_trace_close(&trace_header) < 0)
+        p1perror(2, "Could not write all of the trace");
+    report();
+    metrics_close();
+
+    // Free the jobs and the workload their words live in; a streamed job
+    // has its words and the jobs it's after in allocations of its own
+    for (i = 0; i < n_jobs; i++){
+        if (jobs[i]->max_dependents > 0)
+            free(jobs[i]->dependents);
+        if (i >= n_loaded){
+            free(jobs[i]->after);
+            free(jobs[i]);
+        }
+    }
+    free(loaded);
+    free(jobs);
+    free(ids);
+    free(sources);
+    free(edges);
+    free(order);
+    free(ready);
+    p1workload_destroy(workload);
+    usps_pids_destroy(pids);
+    for (i = 0; i < n_slots; i++){
+        close(slots[i].tfd);
+    }
+    free(slots);
+    if (policy->on_boost != NULL)
+        close(bfd);
+    if (pressure_high > 0)
+        close(pfd);
+    close(epfd);
+    close(sfd);
+
+    // Exit successfully.
+    exit(EXIT_SUCCESS);
+}
+
+// Reads the workload into the jobs array; returns the number of jobs, or
+// -1 with errno ENOMEM if memory ran out, EINVAL if an annotation was bad
+// and ELOOP if the jobs' dependencies form a cycle. With no fd (only jobs
+// streamed in over --listen) the workload is empty
+static int load_workload(int fd){
+    P1Reader *reader;
+    char **words, ***notes, *id;
+    int i, share, count = 0;
+
+    errno = ENOMEM;
+    if (fd >= 0){
+        if ((reader = p1reader_create(fd)) == NULL
+            || (workload = p1workload_read(reader, -1)) == NULL)
+            return -1;
+        p1reader_destroy(reader);
+        count = workload->count;
+    }
+    loaded = (Job *) malloc(sizeof(Job) * (count + 1));
+    jobs = (Job **) malloc(sizeof(Job *) * (count + 1));
+    notes = (char ***) malloc(sizeof(char **) * (count + 1));
+    if (loaded == NULL || jobs == NULL || notes == NULL)
+        return -1;
+    for (i = 0; i < count; i++){
+        if ((words = parse_notes(workload->argv[i], &share, &id)) == NULL)
+            return -1;
+
+        // Skip blank lines
+        if (words[0] == NULL)
+            continue;
+
+        notes[n_jobs] = workload->argv[i];
+        jobs[n_jobs] = &loaded[n_jobs];
+        init_job(jobs[n_jobs], words, share, id);
+        n_jobs++;
+    }
+    n_loaded = n_jobs;
+    i = link_jobs(notes);
+    free(notes);
+    return (i < 0) ? -1 : n_jobs;
+}
+
+// Steps over a line's leading annotations, which are dropped from the
+// job's argv whatever the policy: share=N, id=NAME and after=NAME,NAME...
+// (any number of after= words). Returns the first word of the command,
+// or NULL with errno EINVAL if a share isn't a positive number
+static char **parse_notes(char **words, int *share, char **id){
+    *share = 1;
+    *id = NULL;
+    for (; *words != NULL; words++){
+        if (p1strneq(*words, "share=", 6)){
+            if ((*share = p1atoi(*words + 6)) < 1){
+                errno = EINVAL;
+                return NULL;
+            }
+        } else if (p1strneq(*words, "id=", 3) && (*words)[3] != '\0'){
+            *id = *words + 3;
+        } else if (!p1strneq(*words, "after=", 6)){
+            break;
+        }
+    }
+    return words;
+}
+
+// Fills in a job that's yet to be launched, as the next in the jobs array
+static void init_job(Job *job, char **argv, int share, char *id){
+    job->index = n_jobs;
+    job->argv = argv;
+    job->pid = 0;
+    job->state = JOB_PENDING;
+    job->status = 0;
+    job->prev = job->next = NULL;
+    job->slot = -1;
+    job->cpu = -1;
+    job->started_ns = job->finished_ns = 0;
+    job->slices = 0;
+    job->level = 0;
+    job->cpu_ns = job->slice_cpu_ns = 0;
+    job->quantum_ns = quantum_ns;
+    job->burst_ns = 0;
+    job->nvcsw = job->nivcsw = 0;
+    job->slice_nvcsw = job->slice_nivcsw = 0;
+    job->share = share;
+    job->stride = STRIDE1 / share;
+    job->pass = 0;
+    job->id = id;
+    job->after = job->dependents = NULL;
+    job->n_after = job->n_dependents = job->max_dependents = 0;
+    job->pending = 0;
+    job->ready_ns = job->wait_ns = job->run_ns = 0;
+    job->out_fd = job->log_fd = -1;
+    job->out_bytes = 0;
+    job->rss = job->max_rss = 0;
+}
+
+// FNV-1a, for the map from ids to jobs; kept after linking so that jobs
+// streamed in later can name the ones before them
+static unsigned int id_hash(char *name, int len){
+    unsigned int h = 2166136261u;
+
+    while (len-- > 0)
+        h = (h ^ (unsigned char) *name++) * 16777619u;
+    return h;
+}
+
+// Finds the job with id name[0..len); NULL if there's none
+static Job *find_id(char *name, int len){
+    unsigned int i = id_hash(name, len) & ids_mask;
+
+    if (ids == NULL)
+        return NULL;
+    for (; ids[i] != NULL; i = (i + 1) & ids_mask){
+        if (p1strneq(ids[i]->id, name, len) && ids[i]->id[len] == '\0')
+            return ids[i];
+    }
+    return NULL;
+}
+
+// Adds the job under its id, doubling the map once it's half full;
+// returns -1 if there's no memory for that
+static int add_id(Job *job){
+    unsigned int h;
+
+    if (2 * (n_ids + 1) > ids_mask + 1){
+        Job **old = ids;
+        int size = 16, i;
+
+        while (size < 4 * (n_ids + 1))
+            size *= 2;
+        if ((ids = (Job **) calloc(size, sizeof(Job *))) == NULL){
+            ids = old;
+            return -1;
+        }
+        for (i = 0; old != NULL && i <= ids_mask; i++){
+            if (old[i] == NULL)
+                continue;
+            h = id_hash(old[i]->id, p1strlen(old[i]->id)) & (size - 1);
+            while (ids[h] != NULL)
+                h = (h + 1) & (size - 1);
+            ids[h] = old[i];
+        }
+        free(old);
+        ids_mask = size - 1;
+    }
+    h = id_hash(job->id, p1strlen(job->id)) & ids_mask;
+    while (ids[h] != NULL)
+        h = (h + 1) & ids_mask;
+    ids[h] = job;
+    n_ids++;
+    return 0;
+}
+
+// Walks the after= names in a job's annotations, calling visit on each
+// prerequisite; returns -1 with errno EINVAL if a name isn't the id of
+// any job, or -1 if visit does
+static int each_after(Job *job, char **notes, int (*visit)(Job *, Job *)){
+    char **word, *name;
+    int len;
+
+    for (word = notes; word < job->argv; word++){
+        if (!p1strneq(*word, "after=", 6))
+            continue;
+        for (name = *word + 6; *name != '\0'; name += len + (name[len] == ',')){
+            Job *before;
+
+            for (len = 0; name[len] != '\0' && name[len] != ','; len++)
+                ;
+            if (len == 0)
+                continue;
+            if ((before = find_id(name, len)) == NULL){
+                errno = EINVAL;
+                return -1;
+            }
+            if (visit(job, before) < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+static int count_edge(Job *job, Job *before){
+    job->n_after++;
+    before->n_dependents++;
+    return 0;
+}
+
+static int add_edge(Job *job, Job *before){
+    job->after[job->pending++] = before;
+    before->dependents[before->n_dependents++] = job;
+    return 0;
+}
+
+// Resolves every job's after= names into the jobs it waits for and the
+// jobs waiting for it, all in one array of edges, and puts the jobs in
+// an order where each comes after everything it waits for
+static int link_jobs(char ***notes){
+    int i, n_ready = 0;
+    Job **edge;
+
+    for (i = 0; i < n_jobs; i++){
+        Job *job = jobs[i];
+
+        if (job->id == NULL)
+            continue;
+        if (find_id(job->id, p1strlen(job->id)) != NULL){
+            errno = EINVAL;    // two jobs with the same id
+            return -1;
+        }
+        if (add_id(job) < 0)
+            return -1;
+    }
+
+    for (i = 0; i < n_jobs; i++){
+        if (each_after(jobs[i], notes[i], count_edge) < 0)
+            return -1;
+        n_edges += jobs[i]->n_after;
+    }
+    edges = (Job **) malloc(sizeof(Job *) * (2 * n_edges + 1));
+    order = (Job **) malloc(sizeof(Job *) * (n_jobs + 1));
+    ready = (Job **) malloc(sizeof(Job *) * (n_jobs + 1));
+    if (edges == NULL || order == NULL || ready == NULL)
+        return -1;
+    edge = edges;
+    for (i = 0; i < n_jobs; i++){
+        jobs[i]->after = edge;
+        edge += jobs[i]->n_after;
+    }
+    for (i = 0; i < n_jobs; i++){
+        jobs[i]->dependents = edge;
+        edge += jobs[i]->n_dependents;
+        jobs[i]->n_dependents = 0;
+    }
+    for (i = 0; i < n_jobs; i++){
+        each_after(jobs[i], notes[i], add_edge);
+    }
+
+    // Kahn's algorithm, with the order array doubling as its queue
+    for (i = 0; i < n_jobs; i++){
+        if (jobs[i]->pending == 0)
+            order[n_ready++] = jobs[i];
+    }
+    for (i = 0; i < n_ready; i++){
+        Job *job = order[i];
+        int k;
+
+        for (k = 0; k < job->n_dependents; k++){
+            if (--job->dependents[k]->pending == 0)
+                order[n_ready++] = job->dependents[k];
+        }
+    }
+    if (n_ready < n_jobs){
+        errno = ELOOP;
+        return -1;
+    }
+    for (i = 0; i < n_jobs; i++){
+        jobs[i]->pending = jobs[i]->n_after;
+    }
+    max_jobs = n_jobs;
+    return 0;
+}
+
+// Creates the slots, assigning them the cores we're allowed to run on in
+// turn; asking for more slots than cores doubles slots up on cores
+static int setup_slots(void){
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE], n_cpus = 0, c, i;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        return -1;
+    for (c = 0; c < CPU_SETSIZE; c++){
+        if (CPU_ISSET(c, &allowed))
+            cpus[n_cpus++] = c;
+    }
+    if ((slots = (Slot *) malloc(sizeof(Slot) * n_slots)) == NULL)
+        return -1;
+
+    for (i = 0; i < n_slots; i++){
+        Slot *slot = &slots[i];
+        struct epoll_event ev;
+
+        slot->index = i;
+        slot->cpu = cpus[i % n_cpus];
+        slot->current = NULL;
+        for (c = 0; c < LEVELS; c++){
+            usps_rq_init(&slot->rq[c]);
+        }
+        slot->waiting = 0;
+        slot->deadline_ns = 0;
+        slot->busy_ns = slot->since_ns = 0;
+        slot->switches = 0;
+        slot->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (slot->tfd < 0)
+            return -1;
+        ev.events = EPOLLIN;
+        ev.data.u32 = EV_SLOT + i;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, slot->tfd, &ev);
+    }
+    return 0;
+}
+
+// Puts the job on the slot's queues, wherever the policy has it wait
+static void enqueue(Slot *slot, Job *job){
+    job->slot = slot->index;
+    job->state = JOB_READY;
+    job->ready_ns = usps_now_ns();
+    policy->enqueue(slot, job);
+    slot->waiting++;
+    publish(job);
+}
+
+// Takes a waiting job off whichever of the slot's queues it's on
+static void dequeue(Slot *slot, Job *job){
+    job->wait_ns += usps_now_ns() - job->ready_ns;
+    usps_rq_remove(&slot->rq[job->level], job);
+    slot->waiting--;
+}
+
+// Takes the job the policy picks for the empty slot from its own queues,
+// or when those are empty, the job at the very back of the busiest slot
+static Job *next_job(Slot *slot){
+    Slot *victim = NULL;
+    Job *job;
+    int i;
+
+    if ((job = policy->pick_next(slot, NULL)) != NULL){
+        dequeue(slot, job);
+        return job;
+    }
+    for (i = 0; i < n_slots; i++){
+        if (slots[i].waiting > 0
+            && (victim == NULL || slots[i].waiting > victim->waiting))
+            victim = &slots[i];
+    }
+    if (victim == NULL)
+        return NULL;
+    for (i = LEVELS - 1; victim->rq[i].length == 0; i--)
+        ;
+    job = victim->rq[i].head->prev;
+    dequeue(victim, job);
+    migrations++;
+    return job;
+}
+
+// Notes the job's CPU time, and its context switches if the policy wants
+// them, as a slice begins
+static void slice_begin(Job *job){
+    job->slice_cpu_ns = usps_cpu_ns(job->pid);
+    if (policy->measure & MEASURE_SWITCHES)
+        usps_ctxsw(job->pid, &job->slice_nvcsw, &job->slice_nivcsw);
+}
+
+// Measures what the running job did with its slice and adds it to the
+// job's totals; -1 if /proc can't say
+static int slice_end(Job *job, SliceUse *use){
+    long long now_cpu = usps_cpu_ns(job->pid);
+    long nvcsw, nivcsw;
+
+    if (now_cpu < 0)
+        return -1;
+    use->used = now_cpu - job->slice_cpu_ns;
+    use->blocks = use->preempts = 0;
+    if (policy->measure & MEASURE_SWITCHES){
+        if (usps_ctxsw(job->pid, &nvcsw, &nivcsw) < 0)
+            return -1;
+        use->blocks = nvcsw - job->slice_nvcsw;
+        use->preempts = nivcsw - job->slice_nivcsw;
+        job->nvcsw += use->blocks;
+        job->nivcsw += use->preempts;
+    }
+    job->cpu_ns += use->used;
+    return 0;
+}
+
+// Whether the job spent its slice blocked (see Policy)
+static int blocked(Job *job, SliceUse *use){
+    if (policy->measure & MEASURE_SWITCHES)
+        return use->blocks > 0;
+    return use->used < policy->quantum(job) / 4;
+}
+
+// Puts the job at the back of the slot's queue for its level
+static void push_level(Slot *slot, Job *job){
+    usps_rq_push(&slot->rq[job->level], job);
+}
+
+// The job to run on the slot instead of `current', or next if the slot
+// is free: the head of its highest non-empty queue, unless that's lower
+// than the running job's. NULL leaves the running job where it is
+static Job *pick_top(Slot *slot, Job *current){
+    int i;
+
+    for (i = 0; i < LEVELS; i++){
+        if (slot->rq[i].length > 0)
+            return (current == NULL || i <= current->level)
+                   ? slot->rq[i].head : NULL;
+    }
+    return NULL;
+}
+
+// Whoever has been waiting longest, but only once the slot is free
+static Job *pick_first(Slot *slot, Job *current){
+    return (current == NULL) ? slot->rq[0].head : NULL;
+}
+
+// Length of the job's quantum; it doubles at each feedback level down
+static long long level_quantum(Job *job){
+    return quantum_ns << job->level;
+}
+
+// Or, under the adaptive policy, it's whatever the job has earned
+static long long own_quantum(Job *job){
+    return job->quantum_ns;
+}
+
+// Feedback queues: most of the quantum spent computing means demotion,
+// most of it spent blocked means promotion
+static void demote(Job *job, SliceUse *use){
+    if (use->used >= level_quantum(job) / 4 * 3 && job->level < LEVELS - 1)
+        job->level++;
+}
+
+static void promote(Job *job, SliceUse *use){
+    (void) use;
+    if (job->level > 0)
+        job->level--;
+}
+
+// Every job goes back to the top feedback level, keeping the order they
+// were waiting in
+static void boost_all(void){
+    int i, level;
+
+    for (i = 0; i < n_slots; i++){
+        Slot *slot = &slots[i];
+
+        if (slot->current != NULL)
+            slot->current->level = 0;
+        for (level = 1; level < LEVELS; level++){
+            Job *job;
+
+            while ((job = usps_rq_pop(&slot->rq[level])) != NULL){
+                job->level = 0;
+                usps_rq_push(&slot->rq[0], job);
+            }
+        }
+    }
+}
+
+static void describe_level(Job *job){
+    dprintf(1, " level %d cpu %.1fms", job->level, job->cpu_ns / 1e6);
+}
+
+// The adaptive policy resizes the running job's quantum from what it did
+// with its slice. Every voluntary switch is a point where it blocked, so
+// CPU time over voluntary switches is how long it runs before blocking; a
+// job that blocks gets a quantum of twice that, so a slot isn't left
+// holding a sleeping job, down to a quarter of -quantum
+static void fit_burst(Job *job, SliceUse *use){
+    long long burst = use->used / use->blocks;
+
+    job->burst_ns = (job->burst_ns == 0) ? burst
+                                         : (3 * job->burst_ns + burst) / 4;
+    job->quantum_ns = 2 * job->burst_ns;
+    if (job->quantum_ns < quantum_ns >> ADAPT_MIN_SHIFT)
+        job->quantum_ns = quantum_ns >> ADAPT_MIN_SHIFT;
+    if (job->quantum_ns > quantum_ns)
+        job->quantum_ns = quantum_ns;
+}
+
+// A job that never blocked and either used most of its slice or was
+// preempted by the kernel for it is CPU-bound, and its quantum doubles
+// up to four times -quantum so that it's stopped and continued less
+// often. A job that neither ran nor blocked has been asleep the whole
+// slice and is left alone
+static void stretch(Job *job, SliceUse *use){
+    if (use->used >= job->quantum_ns / 4 * 3 || use->preempts > 0){
+        job->quantum_ns *= 2;
+        if (job->quantum_ns > quantum_ns << ADAPT_MAX_SHIFT)
+            job->quantum_ns = quantum_ns << ADAPT_MAX_SHIFT;
+    }
+}
+
+static void describe_burst(Job *job){
+    dprintf(1, " quantum %.1fms burst %.1fms cpu %.1fms switches %ld/%ld",
+            job->quantum_ns / 1e6, job->burst_ns / 1e6, job->cpu_ns / 1e6,
+            job->nvcsw, job->nivcsw);
+}
+
+// Stride scheduling keeps the one queue in order of pass, each job behind
+// every job with a pass no larger than its own. A job joining for the
+// first time starts a stride past the virtual time
+static void push_pass(Slot *slot, Job *job){
+    if (job->pass == 0){
+        job->pass = global_pass + job->stride;
+        live_shares += job->share;
+    }
+    usps_rq_push_pass(&slot->rq[0], job);
+}
+
+// The job with the smallest pass, if it's smaller than the running job's
+static Job *pick_pass(Slot *slot, Job *current){
+    Job *head = slot->rq[0].head;
+
+    if (head == NULL || (current != NULL && head->pass >= current->pass))
+        return NULL;
+    return head;
+}
+
+// Charges the running job for the CPU time it used over its slice rather
+// than for the whole quantum, so a job that blocks early pays only for
+// what it ran
+static void charge(Job *job, SliceUse *use){
+    job->pass += job->stride * use->used / quantum_ns;
+    if (live_shares > 0)
+        global_pass += STRIDE1 * use->used / quantum_ns / live_shares;
+}
+
+static void leave(Job *job){
+    live_shares -= job->share;
+}
+
+static void describe_share(Job *job){
+    dprintf(1, " share %d (%.1f%%) cpu %.1fms (%.1f%%)", job->share,
+            100.0 * job->share / total_shares, job->cpu_ns / 1e6,
+            total_cpu_ns > 0 ? 100.0 * job->cpu_ns / total_cpu_ns : 0.0);
+}
+
+static Policy rr_policy = {
+    "rr", 0, push_level, pick_top, level_quantum,
+    NULL, NULL, NULL, NULL, NULL
+};
+static Policy fifo_policy = {
+    "fifo", 0, push_level, pick_first, level_quantum,
+    NULL, NULL, NULL, NULL, NULL
+};
+static Policy mlfq_policy = {
+    "mlfq", MEASURE_CPU, push_level, pick_top, level_quantum,
+    demote, promote, NULL, boost_all, describe_level
+};
+static Policy adaptive_policy = {
+    "adaptive", MEASURE_CPU | MEASURE_SWITCHES, push_level, pick_top,
+    own_quantum, stretch, fit_burst, NULL, NULL, describe_burst
+};
+static Policy stride_policy = {
+    "stride", MEASURE_CPU, push_pass, pick_pass, level_quantum,
+    charge, NULL, leave, NULL, describe_share
+};
+
+// Maps the barrier that forked jobs wait on before exec; jobs forked now
+// wait for its generation to move on
+static int launch_begin(void){
+    if (launcher == LAUNCH_FORK && barrier == NULL){
+        void *page = mmap(NULL, sizeof(int), PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (page == MAP_FAILED)
+            return -1;
+        barrier = (volatile int *) page;
+    }
+    return 0;
+}
+
+// Releases the barrier; every job launched behind it is stopped by now,
+// so each one only gets past it once it's first continued
+static void launch_end(void){
+    if (launcher == LAUNCH_FORK){
+        __atomic_add_fetch(barrier, 1, __ATOMIC_RELEASE);
+        syscall(SYS_futex, barrier, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+// Starts the job's process and stops it straight away, without waiting
+// to hear back from it; a job that fails to start is reaped like any
+// other exit
+static int launch(Job *job){
+    pid_t pid;
+    int gen = (barrier != NULL) ? *barrier : 0;   // read before the fork
+    int out = -1;
+
+    // The write end of the pipe its output is captured from
+    if (output_dir != NULL && (out = output_open(job)) < 0)
+        return -1;
+
+    if (launcher == LAUNCH_SPAWN){
+        posix_spawn_file_actions_t actions;
+        posix_spawnattr_t attr;
+        int rc;
+
+        posix_spawn_file_actions_init(&actions);
+        if (out >= 0){
+            posix_spawn_file_actions_adddup2(&actions, out, 1);
+            posix_spawn_file_actions_adddup2(&actions, out, 2);
+        }
+        posix_spawnattr_init(&attr);
+        posix_spawnattr_setsigmask(&attr, &childmask);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+        rc = posix_spawnp(&pid, job->argv[0], &actions, &attr, job->argv,
+                          environ);
+        posix_spawnattr_destroy(&attr);
+        posix_spawn_file_actions_destroy(&actions);
+        if (out >= 0)
+            close(out);
+        if (rc != 0){
+            // Nothing was started, so record it as a failed exec
+            errno = rc;
+            p1perror(2, "Could not execute command");
+            job->status = 127 << 8;
+            job->state = JOB_EXITED;
+            job->started_ns = job->finished_ns = usps_now_ns();
+            output_close(job);
+            return 0;
+        }
+    } else if ((pid = fork()) == 0){
+        // !!! CHILD PROCESS CODE !!!
+        sigprocmask(SIG_SETMASK, &childmask, NULL);
+        if (out >= 0){
+            dup2(out, 1);
+            dup2(out, 2);
+        }
+        while (__atomic_load_n(barrier, __ATOMIC_ACQUIRE) == gen)
+            syscall(SYS_futex, barrier, FUTEX_WAIT, gen, NULL, NULL, 0);
+
+        execvp(job->argv[0], job->argv);
+
+        // If we returned here, then starting the process failed
+        p1perror(2, "Could not execute command");
+        _exit(127);
+    } else if (pid < 0){
+        if (out >= 0){
+            close(out);
+            output_close(job);
+        }
+        return -1;
+    } else if (out >= 0){
+        close(out);
+    }
+    kill(pid, SIGSTOP);
+
+    job->pid = pid;
+    job->started_ns = usps_now_ns();
+    if (usps_pids_put(pids, job) < 0){
+        kill(pid, SIGKILL);
+        return -1;
+    }
+    live++;
+    launched++;
+    enqueue(emptiest(), job);
+    usps_trace(TRACE_SPAWN, job, 0, job->started_ns);
+    return 0;
+}
+
+// The slot with the shortest queue, to spread jobs over the slots
+static Slot *emptiest(void){
+    Slot *slot = &slots[0];
+    int i;
+
+    for (i = 1; i < n_slots; i++){
+        if (slots[i].waiting < slot->waiting)
+            slot = &slots[i];
+    }
+    return slot;
+}
+
+// Whether another job can be launched: not if --jobs are live already,
+// or if as many as memory pressure allows are in rotation
+static int has_room(void){
+    return (max_live == 0 || live < max_live)
+           && live - parked.length < active_max;
+}
+
+// Creates DIR/job-N.out and the pipe the job's stdout and stderr are to
+// be; the read end is watched by the event loop and the write end, which
+// is returned, is the child's. Returns -1 if either can't be made
+static int output_open(Job *job){
+    struct epoll_event ev;
+    char path[PATH_MAX], num[16];
+    int fds[2];
+
+    p1strcpy(path, output_dir);
+    p1strcat(path, "/job-");
+    p1itoa(job->index, num);
+    p1strcat(path, num);
+    p1strcat(path, ".out");
+    job->log_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (job->log_fd < 0)
+        return -1;
+    if (pipe2(fds, O_CLOEXEC) < 0){
+        close(job->log_fd);
+        job->log_fd = -1;
+        return -1;
+    }
+
+    // Only our end is non-blocking; the job's writes block as usual
+    fcntl(fds[0], F_SETPIPE_SZ, OUTPUT_PIPE_SIZE);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    job->out_fd = fds[0];
+    ev.events = EPOLLIN;
+    ev.data.u32 = EV_OUTPUT + job->index;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, job->out_fd, &ev) < 0){
+        close(fds[1]);
+        output_close(job);
+        return -1;
+    }
+    return fds[1];
+}
+
+// The job wrote something: splice it from the pipe to the job's file,
+// never through our memory, until the pipe is empty. At end of file,
+// once the job and anything it started have closed the pipe, or if the
+// file can't be written, the capture is over
+static void on_output(Job *job){
+    ssize_t n;
+
+    if (job->out_fd < 0)
+        return;
+    do {
+        n = splice(job->out_fd, NULL, job->log_fd, NULL, OUTPUT_PIPE_SIZE,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0)
+            job->out_bytes += n;
+    } while (n > 0 || (n < 0 && errno == EINTR));
+    if (n < 0 && errno != EAGAIN)
+        p1perror(2, "Could not capture job output");
+    if (n == 0 || errno != EAGAIN)
+        output_close(job);
+}
+
+// Children forked since may still hold a copy of the read end, which
+// would keep it in the epoll set after our close and wake every wait
+static void output_close(Job *job){
+    if (job->out_fd >= 0){
+        epoll_ctl(epfd, EPOLL_CTL_DEL, job->out_fd, NULL);
+        close(job->out_fd);
+    }
+    if (job->log_fd >= 0)
+        close(job->log_fd);
+    job->out_fd = job->log_fd = -1;
+}
+
+// Launches ready jobs, in workload order, while there's room under --jobs;
+// they all wait on the same barrier generation
+static void admit(void){
+    long long t;
+
+    // Parked jobs have been waiting longer than any new one
+    while (parked.length > 0 && live - parked.length < active_max){
+        Job *job = usps_rq_pop(&parked);
+
+        enqueue(emptiest(), job);
+        usps_trace(TRACE_UNPARK, job, 0, job->ready_ns);
+    }
+
+    if (ready_head == ready_tail || !has_room())
+        return;
+    t = usps_now_ns();
+    while (ready_head < ready_tail && has_room()){
+        Job *job = ready[ready_head++];
+
+        if (launch(job) < 0){
+            p1perror(2, "Could not launch job");
+            exit(EXIT_FAILURE);
+        }
+        if (job->state == JOB_EXITED)
+            complete(job);
+    }
+    launch_end();
+    launch_ns += usps_now_ns() - t;
+}
+
+// Marks a job and everything waiting on it, directly or not, as never run
+static void skip(Job *job){
+    int i;
+
+    job->state = JOB_SKIPPED;
+    publish(job);
+    for (i = 0; i < job->n_dependents; i++){
+        if (job->dependents[i]->state != JOB_SKIPPED)
+            skip(job->dependents[i]);
+    }
+}
+
+// The job has exited: the jobs waiting on it become ready once nothing
+// else holds them back, unless it failed, in which case, as with make,
+// none of them is run
+static void complete(Job *job){
+    int ok = WIFEXITED(job->status) && WEXITSTATUS(job->status) == 0;
+    int i;
+
+    publish(job);
+    for (i = 0; i < job->n_dependents; i++){
+        Job *next = job->dependents[i];
+
+        if (next->state == JOB_SKIPPED)
+            continue;
+        if (!ok)
+            skip(next);
+        else if (--next->pending == 0)
+            ready[ready_tail++] = next;
+    }
+}
+
+// Gives the job the slot's core until an absolute deadline one quantum
+// away, pinning it there first if it last ran somewhere else
+static void dispatch(Slot *slot, Job *job){
+    struct itimerspec its;
+    long long now = usps_now_ns();
+
+    slot->deadline_ns = now + policy->quantum(job);
+    its.it_interval.tv_sec = 0;
+    its.it_interval.tv_nsec = 0;
+    its.it_value.tv_sec = slot->deadline_ns / 1000000000LL;
+    its.it_value.tv_nsec = slot->deadline_ns % 1000000000LL;
+    timerfd_settime(slot->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+
+    job->slices++;
+    if (policy->measure != 0)
+        slice_begin(job);
+    if (job != slot->current){
+        if (job->cpu != slot->cpu){
+            cpu_set_t set;
+
+            CPU_ZERO(&set);
+            CPU_SET(slot->cpu, &set);
+            sched_setaffinity(job->pid, sizeof(set), &set);
+            job->cpu = slot->cpu;
+        }
+        slot->current = job;
+        slot->since_ns = now;
+        job->slot = slot->index;
+        job->state = JOB_RUNNING;
+        kill(job->pid, SIGCONT);
+    }
+    usps_trace(TRACE_DISPATCH, job, policy->quantum(job) / 1000, now);
+    publish(job);
+}
+
+// Takes the running job off the slot, crediting the slot's busy time
+static void vacate(Slot *slot){
+    long long held = usps_now_ns() - slot->since_ns;
+
+    slot->busy_ns += held;
+    slot->current->run_ns += held;
+    slot->current->state = JOB_READY;
+    publish(slot->current);
+    slot->current = NULL;
+}
+
+// Quantum expired: stop the slot's job and continue the next in line
+static void on_quantum(Slot *slot){
+    uint64_t expirations;
+    long long wake, late, now;
+    Job *job, *next;
+    SliceUse use;
+
+    // Stale if the timer was re-armed after it fired
+    if (read(slot->tfd, &expirations, sizeof(expirations))
+        != sizeof(expirations))
+        return;
+    wake = usps_now_ns();
+    late = wake - slot->deadline_ns;
+    usps_stat_add(&jitter, late);
+    if (slot->current == NULL)
+        return;
+    job = slot->current;
+    if (policy->measure != 0 && slice_end(job, &use) == 0){
+        if (policy->on_block != NULL && blocked(job, &use))
+            policy->on_block(job, &use);
+        else if (policy->on_quantum_expired != NULL)
+            policy->on_quantum_expired(job, &use);
+    }
+
+    // Nobody the policy would rather run, so the job just gets another
+    // quantum
+    if ((next = policy->pick_next(slot, job)) == NULL){
+        dispatch(slot, job);
+        return;
+    }
+
+    kill(job->pid, SIGSTOP);
+    vacate(slot);
+    dequeue(slot, next);
+    enqueue(slot, job);
+    usps_trace(TRACE_PREEMPT, job, 0, wake);
+    dispatch(slot, next);
+    now = usps_now_ns();
+    usps_stat_add(&overhead, now - wake);
+    if (metrics != NULL){
+        metrics_begin();
+        metrics->dispatch_hist[usps_hist_bucket(late + now - wake)]++;
+        metrics_end();
+    }
+    slot->switches++;
+    switches++;
+}
+
+// Boost period elapsed
+static void on_boost(void){
+    uint64_t expirations;
+
+    if (read(bfd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return;
+    policy->on_boost();
+    boosts++;
+}
+
+// Reads the resident set of each job in rotation, running or waiting
+static void sample_rss(void){
+    Job *job;
+    int i, level, k;
+
+    for (i = 0; i < n_slots; i++){
+        job = slots[i].current;
+        if (job != NULL && (job->rss = usps_rss(job->pid)) > job->max_rss)
+            job->max_rss = job->rss;
+        for (level = 0; level < LEVELS; level++){
+            RunQueue *rq = &slots[i].rq[level];
+
+            for (k = 0, job = rq->head; k < rq->length; k++, job = job->next){
+                if ((job->rss = usps_rss(job->pid)) > job->max_rss)
+                    job->max_rss = job->rss;
+            }
+        }
+    }
+}
+
+// Takes waiting jobs out of rotation, the biggest resident set first,
+// until no more than active_max are left in it; running jobs are only
+// candidates once their quantum is up
+static void park(void){
+    Job *job, *big;
+    int i, level, k;
+
+    while (live - parked.length > active_max){
+        big = NULL;
+        for (i = 0; i < n_slots; i++){
+            for (level = 0; level < LEVELS; level++){
+                RunQueue *rq = &slots[i].rq[level];
+
+                for (k = 0, job = rq->head; k < rq->length; k++, job = job->next){
+                    if (big == NULL || job->rss > big->rss)
+                        big = job;
+                }
+            }
+        }
+        if (big == NULL)
+            break;
+        dequeue(&slots[big->slot], big);
+        big->state = JOB_PARKED;
+        usps_rq_push(&parked, big);
+        usps_trace(TRACE_PARK, big, 0, usps_now_ns());
+        publish(big);
+        parks++;
+    }
+}
+
+// Sampling period elapsed: from how much longer tasks have stalled on
+// memory, work out the share of the period spent under pressure. At
+// --pressure or above, halve the jobs in rotation; under half of it, and
+// if the limit is what's holding jobs back, let one more in
+static void on_pressure(void){
+    uint64_t expirations;
+    long long now, total, pressure;
+    int active = live - parked.length;
+
+    if (read(pfd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return;
+    now = usps_now_ns();
+    if ((total = usps_pressure_us("memory")) < 0 || now <= pressure_ns)
+        return;
+    pressure = (total - pressure_us) * 1000 * 1000 / (now - pressure_ns);
+    pressure_us = total;
+    pressure_ns = now;
+    if (pressure > peak_pressure)
+        peak_pressure = pressure;
+    sample_rss();
+
+    if (pressure >= pressure_high * 10){
+        active_max = (active / 2 > n_slots) ? active / 2 : n_slots;
+        if (active_max < fewest_active)
+            fewest_active = active_max;
+        park();
+    } else if (pressure < pressure_high * 5 && active >= active_max
+               && active_max < INT_MAX
+               && (parked.length > 0 || ready_head < ready_tail)){
+        active_max++;
+        admit();
+        refill();
+    }
+}
+
+// SIGCHLD arrived: reap everything that exited and unlink it in O(1).
+// SIGINT or SIGTERM, only caught when listening, stops the listening
+static void on_child(void){
+    struct signalfd_siginfo si;
+    int status;
+    pid_t pid;
+
+    // Signals coalesce, so drain the fd and then reap whatever is there
+    while (read(sfd, &si, sizeof(si)) == sizeof(si)){
+        if (si.ssi_signo != SIGCHLD)
+            listen_close();
+    }
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0){
+        Job *job = usps_pids_get(pids, pid);
+
+        if (job == NULL)
+            continue;
+        usps_pids_remove(pids, pid);
+        if (job->state == JOB_RUNNING)
+            vacate(&slots[job->slot]);
+        else if (job->state == JOB_PARKED)
+            usps_rq_remove(&parked, job);
+        else
+            dequeue(&slots[job->slot], job);
+        job->status = status;
+        job->state = JOB_EXITED;
+        job->finished_ns = usps_now_ns();
+        usps_trace(TRACE_EXIT, job, status, job->finished_ns);
+        if (policy->on_exit != NULL)
+            policy->on_exit(job);
+        live--;
+        complete(job);
+    }
+    admit();
+    refill();
+}
+
+// Dispatches the next job on any slot that was left empty, and disarms
+// the timers of any that stay that way
+static void refill(void){
+    struct itimerspec off = {{0, 0}, {0, 0}};
+    int i;
+
+    for (i = 0; i < n_slots; i++){
+        Slot *slot = &slots[i];
+        Job *job;
+
+        if (slot->current != NULL)
+            continue;
+        if ((job = next_job(slot)) != NULL)
+            dispatch(slot, job);
+        else
+            timerfd_settime(slot->tfd, 0, &off, NULL);
+    }
+}
+
+// Opens --listen: reads PATH directly if it's a FIFO, otherwise creates a
+// Unix socket there, first removing any socket an earlier run left behind
+static int listen_open(void){
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct epoll_event ev;
+    struct stat st;
+    int fd;
+
+    if (stat(listen_path, &st) == 0 && S_ISFIFO(st.st_mode)){
+        if ((fd = open(listen_path, O_RDWR | O_NONBLOCK | O_CLOEXEC)) < 0)
+            return -1;
+        if (add_source(fd) < 0){
+            close(fd);
+            return -1;
+        }
+        listening = 1;
+        return 0;
+    }
+    if (p1strlen(listen_path) >= (int) sizeof(addr.sun_path)){
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (stat(listen_path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(listen_path);
+    p1strcpy(addr.sun_path, listen_path);
+    lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (lfd < 0 || bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+        || listen(lfd, SOMAXCONN) < 0)
+        return -1;
+    ev.events = EPOLLIN;
+    ev.data.u32 = EV_LISTEN;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev) < 0)
+        return -1;
+    listening = 1;
+    return 0;
+}
+
+// Stops taking jobs: closes the socket, removing its name, or the FIFO,
+// and every connection, dropping any line left unfinished
+static void listen_close(void){
+    int i;
+
+    if (!listening)
+        return;
+    if (lfd >= 0){
+        close(lfd);
+        unlink(listen_path);
+        lfd = -1;
+    }
+    for (i = 0; i < n_sources; i++){
+        if (sources[i].fd >= 0)
+            close_source(&sources[i]);
+    }
+    listening = 0;
+}
+
+// Watches a new connection (or the FIFO) for lines, in the first free
+// entry of the sources array; returns -1 if it can't
+static int add_source(int fd){
+    struct epoll_event ev;
+    int i;
+
+    for (i = 0; i < n_sources && sources[i].fd >= 0; i++)
+        ;
+    if (i == n_sources){
+        if (n_sources == max_sources){
+            int max = 2 * max_sources + 4;
+            Source *p = (Source *) realloc(sources, sizeof(Source) * max);
+
+            if (p == NULL)
+                return -1;
+            sources = p;
+            max_sources = max;
+        }
+        n_sources++;
+    }
+    ev.events = EPOLLIN;
+    ev.data.u32 = EV_SOURCE + i;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        return -1;
+    sources[i].fd = fd;
+    sources[i].buf = NULL;
+    sources[i].len = sources[i].size = 0;
+    return 0;
+}
+
+static void close_source(Source *src){
+    close(src->fd);
+    src->fd = -1;
+    free(src->buf);
+    src->buf = NULL;
+}
+
+// A client connected; take every connection that's waiting
+static void on_accept(void){
+    int fd;
+
+    while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0){
+        if (add_source(fd) < 0){
+            p1perror(2, "Could not take connection");
+            close(fd);
+        }
+    }
+}
+
+// A source has sent something: admit every whole line it has sent, and
+// at end of file, a last line without a newline too. What comes of it is
+// launched straight away, within --jobs
+static void on_source(Source *src){
+    int n, from, start, eof = 0;
+    char *nl;
+
+    if (src->fd < 0)
+        return;     // closed earlier in this batch of events
+    while (!eof){
+        if (src->len == src->size){
+            int size = 2 * src->size + 4096;
+            char *p = (char *) realloc(src->buf, size + 1);
+
+            if (p == NULL){
+                p1perror(2, "Could not read jobs");
+                close_source(src);
+                break;
+            }
+            src->buf = p;
+            src->size = size;
+        }
+
+        // What's buffered already holds no newline
+        from = src->len;
+        n = read(src->fd, src->buf + src->len, src->size - src->len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            break;
+        if (n <= 0)
+            eof = 1;
+        else
+            src->len += n;
+
+        start = 0;
+        while ((nl = memchr(src->buf + from, '\n', src->len - from)) != NULL){
+            *nl = '\0';
+            submit(src->buf + start);
+            start = from = nl - src->buf + 1;
+        }
+        if (eof && start < src->len){
+            src->buf[src->len] = '\0';
+            submit(src->buf + start);
+            start = src->len;
+        }
+        memmove(src->buf, src->buf + start, src->len - start);
+        src->len -= start;
+        if (eof)
+            close_source(src);
+    }
+    admit();
+    refill();
+}
+
+// Makes room in the arrays with an entry per job for twice as many
+static int grow_jobs(void){
+    int max = 2 * max_jobs + 64;
+    Job **p;
+
+    if ((p = (Job **) realloc(jobs, sizeof(Job *) * (max + 1))) == NULL)
+        return -1;
+    jobs = p;
+    if ((p = (Job **) realloc(order, sizeof(Job *) * (max + 1))) == NULL)
+        return -1;
+    order = p;
+    if ((p = (Job **) realloc(ready, sizeof(Job *) * (max + 1))) == NULL)
+        return -1;
+    ready = p;
+    max_jobs = max;
+    return 0;
+}
+
+static int count_after(Job *job, Job *before){
+    (void) before;
+    job->n_after++;
+    return 0;
+}
+
+// Makes a streamed job wait for one it's after, adding it to that job's
+// dependents, which then need a list of their own. One that has already
+// exited successfully holds nothing back; if it failed or was skipped,
+// this one is skipped too
+static int wait_for(Job *job, Job *before){
+    job->after[job->n_after++] = before;
+    if (before->state == JOB_SKIPPED || (before->state == JOB_EXITED
+        && !(WIFEXITED(before->status) && WEXITSTATUS(before->status) == 0))){
+        job->state = JOB_SKIPPED;
+        return 0;
+    }
+    if (before->state == JOB_EXITED)
+        return 0;
+    if (before->n_dependents == before->max_dependents
+        || before->max_dependents == 0){
+        int max = 2 * before->n_dependents + 4;
+        Job **p = (Job **) malloc(sizeof(Job *) * max);
+
+        if (p == NULL)
+            return -1;
+        if (before->n_dependents > 0)
+            memcpy(p, before->dependents, sizeof(Job *) * before->n_dependents);
+        if (before->max_dependents > 0)
+            free(before->dependents);
+        before->dependents = p;
+        before->max_dependents = max;
+    }
+    before->dependents[before->n_dependents++] = job;
+    job->pending++;
+    return 0;
+}
+
+// Admits one streamed line as the next job; it's ready at once unless
+// it's after jobs that haven't exited. The job, its argv and its words
+// share one allocation. A line that's rejected (a bad share, no command,
+// an id that's taken or unknown, or no memory) is reported and dropped
+static int submit(char *line){
+    int n = p1tokenize(line, NULL), share;
+    char **words, **argv, *id;
+    Job *job;
+
+    if (n == 0)
+        return 0;
+    if (n_jobs == max_jobs && grow_jobs() < 0){
+        p1perror(2, "Could not admit job");
+        return -1;
+    }
+    job = (Job *) malloc(sizeof(Job) + sizeof(char *) * (n + 1)
+                         + p1strlen(line) + 1);
+    if (job == NULL){
+        p1perror(2, "Could not admit job");
+        return -1;
+    }
+    words = (char **) (job + 1);
+    p1strcpy((char *) (words + n + 1), line);
+    p1tokenize((char *) (words + n + 1), words);
+    argv = parse_notes(words, &share, &id);
+    if (argv == NULL || *argv == NULL
+        || (id != NULL && find_id(id, p1strlen(id)) != NULL)){
+        p1putstr(2, "Bad share, no command or duplicate id in job: ");
+        p1putstr(2, line);
+        p1putstr(2, "\n");
+        free(job);
+        return -1;
+    }
+    init_job(job, argv, share, id);
+    if (each_after(job, words, count_after) < 0){
+        p1putstr(2, "Unknown id in job: ");
+        p1putstr(2, line);
+        p1putstr(2, "\n");
+        free(job);
+        return -1;
+    }
+    if ((job->n_after > 0 && (job->after = (Job **) malloc(sizeof(Job *)
+                                            * job->n_after)) == NULL)
+        || (id != NULL && add_id(job) < 0)){
+        p1perror(2, "Could not admit job");
+        free(job->after);
+        free(job);
+        return -1;
+    }
+
+    // Other jobs' lists of dependents can't be put back as they were, so
+    // running out of memory part way through them is the end
+    job->n_after = 0;
+    if (each_after(job, words, wait_for) < 0){
+        p1perror(2, "Could not admit job");
+        exit(EXIT_FAILURE);
+    }
+    n_edges += job->n_after;
+    jobs[n_jobs] = order[n_jobs] = job;
+    n_jobs++;
+    metrics_add(job);
+    if (job->state == JOB_SKIPPED)
+        publish(job);
+    else if (job->pending == 0)
+        ready[ready_tail++] = job;
+    return 0;
+}
+
+// Creates /usps-<pid> and fills in everything that won't change
+static int metrics_open(void){
+    char num[16];
+    int fd, size = METRICS_SIZE(n_slots, n_jobs), i;
+
+    p1strcpy(metrics_name, METRICS_PREFIX);
+    p1itoa((int) getpid(), num);
+    p1strcat(metrics_name, num);
+    if ((fd = shm_open(metrics_name, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0)
+        return -1;
+    if (ftruncate(fd, size) < 0){
+        close(fd);
+        shm_unlink(metrics_name);
+        return -1;
+    }
+    metrics = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (metrics == MAP_FAILED){
+        metrics = NULL;
+        close(fd);
+        shm_unlink(metrics_name);
+        return -1;
+    }
+    metrics_fd = fd;
+    metrics_cap = n_jobs;
+
+    // The segment starts zeroed, so only the non-zero parts need writing
+    metrics->version = METRICS_VERSION;
+    metrics->size = size;
+    metrics->n_slots = n_slots;
+    metrics->n_jobs = n_jobs;
+    p1strcpy(metrics->policy, policy->name);
+    metrics->quantum_ns = quantum_ns;
+    for (i = 0; i < n_slots; i++){
+        METRICS_SLOTS(metrics)[i].cpu = slots[i].cpu;
+        METRICS_SLOTS(metrics)[i].current = -1;
+    }
+    for (i = 0; i < n_jobs; i++){
+        metrics_add(jobs[i]);
+    }
+    __atomic_store_n(&metrics->magic, METRICS_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Fills in a job's entry, first doubling the segment if the job was
+// streamed in past the end of it. Readers see the new size under the
+// sequence lock and map the rest; if it can't grow, the job goes unseen
+static void metrics_add(Job *job){
+    UspsMetricsJob *mj;
+    char **word;
+    int len = 0;
+
+    if (metrics == NULL)
+        return;
+    if (job->index >= metrics_cap){
+        int cap = 2 * metrics_cap + 64, size = METRICS_SIZE(n_slots, cap);
+        void *p;
+
+        if (ftruncate(metrics_fd, size) < 0)
+            return;
+        p = mremap(metrics, metrics->size, size, MREMAP_MAYMOVE);
+        if (p == MAP_FAILED)
+            return;
+        metrics = (UspsMetrics *) p;
+        metrics_cap = cap;
+        metrics_begin();
+        metrics->size = size;
+    } else
+        metrics_begin();
+    mj = &METRICS_JOBS(metrics)[job->index];
+    mj->state = job->state;
+    mj->slot = -1;
+    for (word = job->argv; *word != NULL; word++){
+        char *c;
+
+        for (c = *word; *c != '\0' && len < (int) sizeof(mj->name) - 1; c++)
+            mj->name[len++] = *c;
+        if (len < (int) sizeof(mj->name) - 1 && word[1] != NULL)
+            mj->name[len++] = ' ';
+    }
+    metrics_end();
+}
+
+// Marks the segment as being written; readers retry until metrics_end.
+// Only ever brackets plain stores, never a system call, so the window
+// stays a few hundred nanoseconds however busy the event loop is
+static void metrics_begin(void){
+    metrics->seq++;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// Marks the segment consistent again
+static void metrics_end(void){
+    __atomic_store_n(&metrics->seq, metrics->seq + 1, __ATOMIC_RELEASE);
+}
+
+// Refreshes the totals, once per batch of events
+static void metrics_totals(void){
+    long long now = usps_now_ns();
+    int i;
+
+    if (metrics == NULL)
+        return;
+    metrics_begin();
+    metrics->live = live;
+    metrics->n_jobs = (n_jobs < metrics_cap) ? n_jobs : metrics_cap;
+    metrics->started_ns = began_ns;
+    metrics->updated_ns = now;
+    metrics->switches = switches;
+    for (i = 0; i < n_slots; i++){
+        UspsMetricsSlot *ms = &METRICS_SLOTS(metrics)[i];
+
+        ms->current = (slots[i].current != NULL) ? slots[i].current->index : -1;
+        ms->waiting = slots[i].waiting;
+        ms->switches = slots[i].switches;
+    }
+    metrics_end();
+}
+
+// Copies a job's state into the segment; plain stores, no system calls
+static void publish(Job *job){
+    UspsMetricsJob *mj;
+
+    if (metrics == NULL || job->index >= metrics_cap)
+        return;
+    mj = &METRICS_JOBS(metrics)[job->index];
+    metrics_begin();
+    mj->pid = (int) job->pid;
+    mj->state = job->state;
+    mj->slices = job->slices;
+    mj->slot = job->slot;
+    mj->cpu_ns = job->cpu_ns;
+    mj->run_ns = job->run_ns;
+    mj->wait_ns = job->wait_ns;
+    metrics_end();
+}
+
+// Tells readers the run is over and removes the segment's name; anyone
+// with it mapped can still read the final numbers
+static void metrics_close(void){
+    if (metrics == NULL)
+        return;
+    metrics_totals();
+    metrics_begin();
+    metrics->finished = 1;
+    metrics_end();
+    munmap(metrics, metrics->size);
+    close(metrics_fd);
+    shm_unlink(metrics_name);
+}
+
+// Reports the longest chain of jobs, each waiting on the one before, by
+// the time each took from launch to exit: no number of CPUs could have
+// finished the workload sooner. A skipped job takes no time
+static void critical_path(long long wall){
+    long long *path = (long long *) malloc(sizeof(long long) * n_jobs);
+    Job **via = (Job **) malloc(sizeof(Job *) * n_jobs), *end = NULL;
+    int i, k, length = 0;
+
+    if (path == NULL || via == NULL){
+        free(path);
+        free(via);
+        return;
+    }
+    for (i = 0; i < n_jobs; i++){
+        Job *job = order[i];
+        int j = job->index;
+
+        via[j] = NULL;
+        for (k = 0; k < job->n_after; k++){
+            Job *before = job->after[k];
+
+            if (via[j] == NULL || path[before->index] > path[via[j]->index])
+                via[j] = before;
+        }
+        path[j] = (job->state == JOB_EXITED)
+                  ? job->finished_ns - job->started_ns : 0;
+        if (via[j] != NULL)
+            path[j] += path[via[j]->index];
+        if (end == NULL || path[j] > path[end->index])
+            end = job;
+    }
+
+    // Walk back from the end of the chain, reusing order to reverse it
+    for (; end != NULL; end = via[end->index])
+        order[length++] = end;
+    dprintf(1, "critical path %.1fms of %.1fms wall:",
+            path[order[0]->index] / 1e6, wall / 1e6);
+    while (length-- > 0){
+        if (order[length]->id != NULL)
+            dprintf(1, " %s", order[length]->id);
+        else
+            dprintf(1, " job %d", order[length]->index);
+        if (length > 0)
+            dprintf(1, " ->");
+    }
+    dprintf(1, "\n");
+    free(path);
+    free(via);
+}
+
+// Per-job results followed by the cost of scheduling them
+static void report(void){
+    long long wall = usps_now_ns() - began_ns;
+    char **word;
+    int i;
+
+    // Stride jobs should have had CPU in proportion to their shares
+    for (i = 0; i < n_jobs; i++){
+        total_cpu_ns += jobs[i]->cpu_ns;
+        total_shares += jobs[i]->share;
+    }
+
+    for (i = 0; i < n_jobs; i++){
+        Job *job = jobs[i];
+        int code = WIFEXITED(job->status) ? WEXITSTATUS(job->status)
+                                           : 128 + WTERMSIG(job->status);
+
+        dprintf(1, "job %d", job->index);
+        if (job->id != NULL)
+            dprintf(1, " (%s)", job->id);
+        if (job->state == JOB_SKIPPED){
+            dprintf(1, " skipped:");
+            for (word = job->argv; *word != NULL; word++){
+                dprintf(1, " %s", *word);
+            }
+            dprintf(1, "\n");
+            continue;
+        }
+        dprintf(1, " pid %d exit %d turnaround %.1fms slices %d",
+                (int) job->pid, code,
+                (job->finished_ns - job->started_ns) / 1e6, job->slices);
+        if (policy->describe != NULL)
+            policy->describe(job);
+        if (output_dir != NULL)
+            dprintf(1, " output %lld bytes", job->out_bytes);
+        if (pressure_high > 0)
+            dprintf(1, " rss %.1fMB", job->max_rss / 1048576.0);
+        dprintf(1, ":");
+        for (word = job->argv; *word != NULL; word++){
+            dprintf(1, " %s", *word);
+        }
+        dprintf(1, "\n");
+    }
+    for (i = 0; i < n_slots; i++){
+        dprintf(1, "slot %d cpu %d utilization %.1f%% switches %ld\n",
+                i, slots[i].cpu,
+                wall > 0 ? 100.0 * slots[i].busy_ns / wall : 0.0,
+                slots[i].switches);
+    }
+    dprintf(1, "launched %d jobs in %.1fms (%.0f jobs/sec)\n", launched,
+            launch_ns / 1e6, launch_ns > 0 ? launched * 1e9 / launch_ns : 0.0);
+    dprintf(1, "context switches %ld migrations %ld\n", switches, migrations);
+    if (policy->on_boost != NULL)
+        dprintf(1, "priority boosts %ld\n", boosts);
+    if (pressure_high > 0){
+        dprintf(1, "memory pressure peak %.1f%% parked %ld times",
+                peak_pressure / 10.0, parks);
+        if (fewest_active < INT_MAX)
+            dprintf(1, " fewest in rotation %d", fewest_active);
+        dprintf(1, "\n");
+    }
+    if (trace_path != NULL)
+        dprintf(1, "trace %ld events (%ld dropped) in %s\n",
+                trace_header.records, trace_header.dropped, trace_path);
+    if (n_edges > 0)
+        critical_path(wall);
+    usps_stat_print(1, "timer jitter", &jitter);
+    usps_stat_print(1, "dispatch overhead", &overhead);
+}
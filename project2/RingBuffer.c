@@ -0,0 +1,403 @@
+/*
+ * RingBuffer.c
+ *
+ * Lock-free single- and multiple-producer rings behind the BoundedBuffer
+ * interface; see RingBuffer.h.
+ *
+ * Both rings count items with indices that only ever grow, and keep item
+ * i in cell i % size.  The SPSC ring needs nothing more: the producer is
+ * the only writer of tail and the consumer the only writer of head, and
+ * each keeps a copy of the other's index so it only reads the other's
+ * cache line when the ring looks full or empty.  The MPSC ring gives
+ * every cell a sequence number (after Vyukov's bounded queue): a cell is
+ * free for the writer of item i when its sequence is i, holds item i
+ * when it's i + 1, and is handed on to item i + size once read.  Writers
+ * claim item numbers by advancing tail with a compare-and-swap, and a
+ * writer that has claimed a cell but not yet filled it only ever holds
+ * up the reader, which sees the cell as still empty.
+ *
+ * The batched calls move a run of items for the price of one: one look
+ * at the other side's index, one index update, and at most one wakeup.
+ * An MPSC writer claims a run of cells with a single compare-and-swap;
+ * head is published with release order after the cells it frees, so
+ * any cell below head + size is known to be free.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "RingBuffer.h"
+
+#define CACHE_LINE 64
+#define ALIGNED __attribute__((aligned(CACHE_LINE)))
+
+typedef struct ring_cell
+{
+    unsigned long seq;      /* MPSC only; see above */
+    void *item;
+} RingCell;
+
+struct ring_buffer
+{
+    /* Written by the producer(s) */
+    unsigned long tail ALIGNED;
+    unsigned long head_cache;       /* SPSC producer's last look at head */
+
+    /* Written by the consumer */
+    unsigned long head ALIGNED;
+    unsigned long tail_cache;       /* SPSC consumer's last look at tail */
+
+    /* Only touched once the ring is empty or full */
+    int readers_waiting ALIGNED;
+    int writers_waiting;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+
+    /* Fixed at creation */
+    int mpsc ALIGNED;
+    unsigned long size;
+    RingCell *cells;
+};
+
+static RingBuffer *createRB(int size, int mpsc)
+{
+    RingBuffer *rb;
+    void *mem;
+    int i;
+
+    if (size <= 0 || posix_memalign(&mem, CACHE_LINE, sizeof(RingBuffer)))
+        return NULL;
+    rb = (RingBuffer *) mem;
+    rb->cells = (RingCell *) malloc(size * sizeof(RingCell));
+    if (rb->cells == NULL)
+    {
+        free(rb);
+        return NULL;
+    }
+    for (i = 0; i < size; i++)
+    {
+        rb->cells[i].seq = i;
+        rb->cells[i].item = NULL;
+    }
+    rb->head = rb->tail = 0;
+    rb->head_cache = rb->tail_cache = 0;
+    rb->readers_waiting = rb->writers_waiting = 0;
+    rb->mpsc = mpsc;
+    rb->size = size;
+    pthread_mutex_init(&rb->lock, NULL);
+    pthread_cond_init(&rb->not_empty, NULL);
+    pthread_cond_init(&rb->not_full, NULL);
+    return rb;
+}
+
+RingBuffer *createSPSCRB(int size)
+{
+    return createRB(size, 0);
+}
+
+RingBuffer *createMPSCRB(int size)
+{
+    return createRB(size, 1);
+}
+
+void destroyRB(RingBuffer *rb)
+{
+    pthread_mutex_destroy(&rb->lock);
+    pthread_cond_destroy(&rb->not_empty);
+    pthread_cond_destroy(&rb->not_full);
+    free(rb->cells);
+    free(rb);
+}
+
+/*
+ * Stores the item if there's room; 1 if it was stored
+ */
+static int put(RingBuffer *rb, void *item)
+{
+    unsigned long pos;
+    RingCell *cell;
+
+    if (!rb->mpsc)
+    {
+        pos = rb->tail;
+        if (pos - rb->head_cache >= rb->size)
+        {
+            rb->head_cache = __atomic_load_n(&rb->head, __ATOMIC_ACQUIRE);
+            if (pos - rb->head_cache >= rb->size)
+                return 0;
+        }
+        rb->cells[pos % rb->size].item = item;
+        __atomic_store_n(&rb->tail, pos + 1, __ATOMIC_RELEASE);
+        return 1;
+    }
+
+    pos = __atomic_load_n(&rb->tail, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        long dif;
+
+        cell = &rb->cells[pos % rb->size];
+        dif = (long) (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+        if (dif == 0)
+        {
+            /* The cell is free; claim it unless another writer got it */
+            if (__atomic_compare_exchange_n(&rb->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        }
+        else if (dif < 0)
+        {
+            /* Still holding the item from a lap ago - full */
+            return 0;
+        }
+        else
+        {
+            /* Another writer claimed it; try the new tail */
+            pos = __atomic_load_n(&rb->tail, __ATOMIC_RELAXED);
+        }
+    }
+    cell->item = item;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/*
+ * Takes the oldest item if there is one; 1 if there was
+ */
+static int take(RingBuffer *rb, void **item)
+{
+    unsigned long pos = rb->head;
+    RingCell *cell = &rb->cells[pos % rb->size];
+
+    if (!rb->mpsc)
+    {
+        if (pos == rb->tail_cache)
+        {
+            rb->tail_cache = __atomic_load_n(&rb->tail, __ATOMIC_ACQUIRE);
+            if (pos == rb->tail_cache)
+                return 0;
+        }
+        *item = cell->item;
+        __atomic_store_n(&rb->head, pos + 1, __ATOMIC_RELEASE);
+        return 1;
+    }
+
+    if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos + 1)
+        return 0;
+    *item = cell->item;
+    __atomic_store_n(&cell->seq, pos + rb->size, __ATOMIC_RELEASE);
+    __atomic_store_n(&rb->head, pos + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/*
+ * Stores as many of the n items as there's room for, in order; returns
+ * how many that was
+ */
+static int put_many(RingBuffer *rb, void **items, int n)
+{
+    unsigned long pos, room;
+    int i, k;
+
+    if (!rb->mpsc)
+    {
+        pos = rb->tail;
+        room = rb->size - (pos - rb->head_cache);
+        if (room < (unsigned long) n)
+        {
+            rb->head_cache = __atomic_load_n(&rb->head, __ATOMIC_ACQUIRE);
+            room = rb->size - (pos - rb->head_cache);
+        }
+        k = (room < (unsigned long) n) ? (int) room : n;
+        for (i = 0; i < k; i++)
+            rb->cells[(pos + i) % rb->size].item = items[i];
+        if (k > 0)
+            __atomic_store_n(&rb->tail, pos + k, __ATOMIC_RELEASE);
+        return k;
+    }
+
+    pos = __atomic_load_n(&rb->tail, __ATOMIC_RELAXED);
+    do
+    {
+        room = __atomic_load_n(&rb->head, __ATOMIC_ACQUIRE) + rb->size - pos;
+        if ((long) room <= 0)
+            return 0;
+        k = (room < (unsigned long) n) ? (int) room : n;
+    } while (!__atomic_compare_exchange_n(&rb->tail, &pos, pos + k, 1,
+                                          __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+    for (i = 0; i < k; i++)
+    {
+        RingCell *cell = &rb->cells[(pos + i) % rb->size];
+
+        cell->item = items[i];
+        __atomic_store_n(&cell->seq, pos + i + 1, __ATOMIC_RELEASE);
+    }
+    return k;
+}
+
+/*
+ * Takes up to max of the oldest items; returns how many it took
+ */
+static int take_many(RingBuffer *rb, void **items, int max)
+{
+    unsigned long pos = rb->head;
+    int i, k;
+
+    if (!rb->mpsc)
+    {
+        if (rb->tail_cache - pos < (unsigned long) max)
+            rb->tail_cache = __atomic_load_n(&rb->tail, __ATOMIC_ACQUIRE);
+        k = (rb->tail_cache - pos < (unsigned long) max)
+            ? (int) (rb->tail_cache - pos) : max;
+        for (i = 0; i < k; i++)
+            items[i] = rb->cells[(pos + i) % rb->size].item;
+        if (k > 0)
+            __atomic_store_n(&rb->head, pos + k, __ATOMIC_RELEASE);
+        return k;
+    }
+
+    for (k = 0; k < max; k++)
+    {
+        RingCell *cell = &rb->cells[(pos + k) % rb->size];
+
+        if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos + k + 1)
+            break;
+        items[k] = cell->item;
+        __atomic_store_n(&cell->seq, pos + k + rb->size, __ATOMIC_RELEASE);
+    }
+    if (k > 0)
+        __atomic_store_n(&rb->head, pos + k, __ATOMIC_RELEASE);
+    return k;
+}
+
+/*
+ * Wakes a thread parked on `cond', if any are, or all of them if `all'
+ * (when more than one item or cell has turned up).  The fence pairs with
+ * the one a parking thread makes between counting itself and checking
+ * the ring again: either it sees what was just done, or this sees it
+ * waiting
+ */
+static void wake(RingBuffer *rb, int *waiting, pthread_cond_t *cond, int all)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_RELAXED) > 0)
+    {
+        pthread_mutex_lock(&rb->lock);
+        if (all)
+            pthread_cond_broadcast(cond);
+        else
+            pthread_cond_signal(cond);
+        pthread_mutex_unlock(&rb->lock);
+    }
+}
+
+int nonblockingWriteRB(RingBuffer *rb, void *item)
+{
+    if (!put(rb, item))
+        return 0;
+    wake(rb, &rb->readers_waiting, &rb->not_empty, 0);
+    return 1;
+}
+
+void blockingWriteRB(RingBuffer *rb, void *item)
+{
+    if (!put(rb, item))
+    {
+        pthread_mutex_lock(&rb->lock);
+        __atomic_add_fetch(&rb->writers_waiting, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        while (!put(rb, item))
+            pthread_cond_wait(&rb->not_full, &rb->lock);
+        __atomic_sub_fetch(&rb->writers_waiting, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&rb->lock);
+    }
+    wake(rb, &rb->readers_waiting, &rb->not_empty, 0);
+}
+
+int nonblockingReadRB(RingBuffer *rb, void **item)
+{
+    if (!take(rb, item))
+        return 0;
+    wake(rb, &rb->writers_waiting, &rb->not_full, 0);
+    return 1;
+}
+
+void *blockingReadRB(RingBuffer *rb)
+{
+    void *item;
+
+    if (!take(rb, &item))
+    {
+        pthread_mutex_lock(&rb->lock);
+        __atomic_add_fetch(&rb->readers_waiting, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        while (!take(rb, &item))
+            pthread_cond_wait(&rb->not_empty, &rb->lock);
+        __atomic_sub_fetch(&rb->readers_waiting, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&rb->lock);
+    }
+    wake(rb, &rb->writers_waiting, &rb->not_full, 0);
+    return item;
+}
+
+int nonblockingWriteManyRB(RingBuffer *rb, void **items, int n)
+{
+    int k = put_many(rb, items, n);
+
+    if (k > 0)
+        wake(rb, &rb->readers_waiting, &rb->not_empty, 0);
+    return k;
+}
+
+void blockingWriteManyRB(RingBuffer *rb, void **items, int n)
+{
+    while (n > 0)
+    {
+        int k = put_many(rb, items, n);
+
+        if (k == 0)
+        {
+            pthread_mutex_lock(&rb->lock);
+            __atomic_add_fetch(&rb->writers_waiting, 1, __ATOMIC_SEQ_CST);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            while ((k = put_many(rb, items, n)) == 0)
+                pthread_cond_wait(&rb->not_full, &rb->lock);
+            __atomic_sub_fetch(&rb->writers_waiting, 1, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&rb->lock);
+        }
+        wake(rb, &rb->readers_waiting, &rb->not_empty, 0);
+        items += k;
+        n -= k;
+    }
+}
+
+int nonblockingReadManyRB(RingBuffer *rb, void **items, int max)
+{
+    int k = take_many(rb, items, max);
+
+    if (k > 0)
+        wake(rb, &rb->writers_waiting, &rb->not_full, k > 1);
+    return k;
+}
+
+int blockingReadManyRB(RingBuffer *rb, void **items, int max)
+{
+    int k;
+
+    if (max <= 0)
+        return 0;
+    if ((k = take_many(rb, items, max)) == 0)
+    {
+        pthread_mutex_lock(&rb->lock);
+        __atomic_add_fetch(&rb->readers_waiting, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        while ((k = take_many(rb, items, max)) == 0)
+            pthread_cond_wait(&rb->not_empty, &rb->lock);
+        __atomic_sub_fetch(&rb->readers_waiting, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&rb->lock);
+    }
+    wake(rb, &rb->writers_waiting, &rb->not_full, k > 1);
+    return k;
+}
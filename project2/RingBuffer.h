@@ -0,0 +1,71 @@
+#ifndef __RING_BUFFER_HDR
+#define __RING_BUFFER_HDR
+
+/*
+ * RingBuffer.h
+ *
+ * Header file for a lock-free bounded buffer with the same interface as
+ * BoundedBuffer, for hops where each item would otherwise pay for a mutex
+ * and a condition variable.
+ *
+ * Two variants are provided.  A single-producer single-consumer ring may
+ * only ever be written by one thread and read by one thread; each side
+ * then owns its index and only reads the other's when it seems to have
+ * caught up.  A multiple-producer single-consumer ring may be written by
+ * any number of threads, which claim slots with a compare-and-swap, but
+ * still read by only one.  The head and tail indices sit on cache lines
+ * of their own, so producer and consumer don't contend for one.
+ *
+ * Neither variant takes a lock while an item can be moved.  A blocking
+ * call only parks its thread, on a mutex and condition variable kept for
+ * the purpose, once the ring is actually empty (for a reader) or full
+ * (for a writer), and the other side only touches them when somebody is
+ * parked.
+ *
+ * Uses heap allocated data structures.
+ */
+
+/* opaque data structure representing RingBuffer instance */
+typedef struct ring_buffer RingBuffer;
+
+/*
+ * create a ring buffer to hold `size' items, for one writer thread or
+ * for many; return NULL if error
+ */
+RingBuffer *createSPSCRB(int size);
+RingBuffer *createMPSCRB(int size);
+
+/* destroy the ring buffer, returning all heap-allocated memory */
+void destroyRB(RingBuffer *rb);
+
+/*
+ * write methods on RB; blocking call causes calling thread to block
+ * until there is room in the RB; nonblocking call returns 1 if item
+ * successfully stored in the RB, 0 otherwise
+ */
+void blockingWriteRB(RingBuffer *rb, void *item);
+int nonblockingWriteRB(RingBuffer *rb, void *item);
+
+/*
+ * read methods on RB; blocking call causes calling thread to block
+ * until there is an item in the RB; nonblocking call returns 1 if item
+ * was succesfully retrieved from the RB, 0 otherwise
+ */
+void *blockingReadRB(RingBuffer *rb);
+int nonblockingReadRB(RingBuffer *rb, void **item);
+
+/*
+ * batched versions of the above, which pay for synchronization once
+ * per call rather than once per item; blocking write stores all `n'
+ * items in order, blocking as often as it needs to; nonblocking write
+ * stores as many of the first items as there is room for and returns
+ * how many that was; blocking read blocks until there is at least one
+ * item and returns how many (up to `max') it took; nonblocking read
+ * returns how many it took, 0 if the RB was empty
+ */
+void blockingWriteManyRB(RingBuffer *rb, void **items, int n);
+int nonblockingWriteManyRB(RingBuffer *rb, void **items, int n);
+int blockingReadManyRB(RingBuffer *rb, void **items, int max);
+int nonblockingReadManyRB(RingBuffer *rb, void **items, int max);
+
+#endif /* __RING_BUFFER_HDR */
@@ -32,15 +32,22 @@
 /* For argument parsing in the logging functions */
 #include <stdarg.h>
 
-/* For sleep (just for context switches I swear!) */
-#include <unistd.h>
+/* For timing out idle clients and timing retries */
+#include <time.h>
+
+/* For yielding while a client's buffer is being reclaimed */
+#include <sched.h>
 
 /* For storing incoming and outgoing packets on nonblocking calls */
 #include "BoundedBuffer.h"
+#include "RingBuffer.h"
 
 /* For the packet descriptors themselves */
 #include "packetdescriptor.h"
 
+/* For queueing outgoing packets per destination */
+#include "generic_queue.h"
+
 /* For the network gateway to send/receive packets */
 #include "networkdevice.h"
 
@@ -65,11 +72,25 @@
 
 /* Forward declarations of private functions */
 
-/* Locate a client's buffer based on PID */
-int find_client(PID);
+/* Locate the queue of outgoing packets for a destination */
+typedef struct dest_queue DestQueue;
+DestQueue *find_dest(Destination);
+void make_ready(DestQueue *);
+void record_attempt(DestQueue *, int);
+void schedule_retry(DestQueue *, PacketDescriptor *, int, unsigned int *);
+long long now_ns(void);
+
+/* Locate a client based on PID, and take and drop its buffer */
+typedef struct client Client;
+Client *find_client(PID);
+BoundedBuffer *acquire_client(Client *, int);
+void release_client(Client *);
+void reclaim_idle_clients(void);
 
 /* Thread functions */
 void *snd_func(void *);
+void *snd_worker(void *);
+void *snd_timer(void *);
 void *rcv_listen(void *);
 void *rcv_process(void *);
 void *rcv_upkeep(void *);
@@ -97,18 +118,28 @@ NetworkDevice *ND;
 /*
  * Thread IDs for all threads used
  * 
- * SND sends packets from the SND_BUF buffer out onto the network
+ * SND takes packets from the SND_BUF buffer and sorts them into a 
+ *     queue per destination
+ * 
+ * SND_POOL[] send packets from those queues out onto the network, 
+ *     one destination per worker at a time
+ * 
+ * SND_TIMER hands destinations waiting to retry a failed send back 
+ *     to the workers once their backoff has passed
  * 
  * RCV_LISTEN listens to the network and places packets into an 
  *     intermediate buffer
  * 
  * RCV_PROCESS takes packets from the intermediate buffer RCV_TEMP 
- *     and places them into the right GET_BUF[] element
+ *     and places them into the right client's buffer
  * 
- * RCV_UPKEEP maintains the auxiliary PD that the RCV_LISTEN thread
- *     uses to register new packet descriptors quickly.
+ * RCV_UPKEEP keeps RCV_STASH topped up with fresh packet descriptors
+ *     so the RCV_LISTEN thread can re-register without waiting.
  */
+#define SND_WORKERS 4
 pthread_t SND;
+pthread_t SND_POOL[SND_WORKERS];
+pthread_t SND_TIMER;
 pthread_t RCV_LISTEN;
 pthread_t RCV_PROCESS;
 pthread_t RCV_UPKEEP;
@@ -116,34 +147,174 @@ pthread_t RCV_UPKEEP;
 /*
  * Pointers for bounded buffers
  * 
- * SND_BUF holds the queued packet descriptors to be sent out
+ * SND_BUF holds the queued packet descriptors to be sent out; any 
+ *     application may write to it but only the SND thread reads it, 
+ *     so it is a lock-free MPSC ring
  * 
- * GET_BUF[] holds the array of queued packet descriptors awaiting 
- *     pickup from their application
+ * Each client's buffer holds the queued packet descriptors awaiting 
+ *     pickup from their application; RCV_PROCESS also reads from 
+ *     these to drop the oldest packet, so they stay locked
  * 
  * RCV_TEMP holds the packets waiting for sorting by the RCV_PROCESS
- *     thread
+ *     thread; only RCV_LISTEN writes to it, so it is a lock-free 
+ *     SPSC ring
+ * 
+ * RCV_STASH holds initialized packet descriptors ready to replace 
+ *     DEST; RCV_UPKEEP fills it and RCV_LISTEN drains it, so it is 
+ *     also an SPSC ring
  */
-BoundedBuffer *SND_BUF;
-BoundedBuffer *GET_BUF[MAX_PID];
-BoundedBuffer *RCV_TEMP;
+RingBuffer *SND_BUF;
+RingBuffer *RCV_TEMP;
+RingBuffer *RCV_STASH;
 
 /* Size limitations for bounded buffers */
 /* DEVNOTE: Make sure, if changing, that the totals never exceed the 
    amount available in the FPDS. */
 const int SND_SIZE          = 10;
-const int GET_SIZE          = 2; /* this * MAX_PID possible */
+const int GET_SIZE          = 2; /* this * live clients possible */
 const int RCV_TEMP_SIZE     = 3;
+const int RCV_STASH_SIZE    = 4; /* longest burst taken without drops */
+const int SND_HELD_SIZE     = 16; /* taken from SND_BUF, not yet done */
+const int DEST_QUEUE_SIZE   = 4; /* past this, a failing one sheds */
+
+/*
+ * Outgoing packets, queued per destination
+ * 
+ * Each destination seen gets a DestQueue, found through a hash table 
+ *     and kept for as long as the driver runs. A queue with packets 
+ *     waiting sits on the SND_READY list until a worker takes it; 
+ *     the worker sends the oldest packet and, if more are waiting, 
+ *     puts the queue back at the end of the list. A queue is never 
+ *     on the list and in a worker's hands at once, so each 
+ *     destination's packets go out in the order they were queued, 
+ *     while a slow destination holds up only the worker sending to 
+ *     it. Everything here is guarded by SND_LOCK.
+ * 
+ * SND only takes packets from SND_BUF while the senders hold fewer 
+ *     than SND_HELD_SIZE between them, waiting on SND_ROOM 
+ *     otherwise, so when the senders fall behind SND_BUF fills and 
+ *     blocks the applications, rather than draining the FPDS. A 
+ *     destination already holding DEST_QUEUE_SIZE whose last try 
+ *     failed gives up its oldest waiting packet to make way for a new
+ *     one, so a failing destination can neither stall the sorting 
+ *     nor take up all of SND_HELD_SIZE.
+ * 
+ * A send is tried once at a time. When it fails, the packet stays at
+ *     the head of its destination, which goes on the SND_RETRY list,
+ *     ordered by when it's due, instead of back on SND_READY; the 
+ *     worker goes straight on to other destinations and SND_TIMER 
+ *     makes the destination ready again once it's due. The wait 
+ *     doubles with every failed try, from SND_RETRY_BASE_MS up to 
+ *     SND_RETRY_MAX_MS, and a random half of it is taken off so 
+ *     destinations that failed together don't retry together.
+ * 
+ * Each destination keeps a moving average of how often a single try
+ *     gets through, and gives a packet as many tries as it takes to
+ *     get it through 19 times in 20 (SND_MIN_TRIES to SND_MAX_TRIES).
+ *     A destination where even SND_MAX_TRIES would more likely than 
+ *     not fail gets SND_MIN_TRIES, so it can't tie up the retry 
+ *     queue; it's still tried, so its average can recover.
+ */
+#define DEST_BUCKETS 64
 
-/* Array of client PIDs */
-PID CLIENTS[MAX_PID];
+#define SND_RETRY_BASE_MS   4
+#define SND_RETRY_MAX_MS    250
+#define SND_MIN_TRIES       2
+#define SND_MAX_TRIES       8
+
+struct dest_queue
+{
+    Destination dest;
+    
+    /* Packets waiting, oldest first */
+    GQueue *packets;
+    
+    /* On the SND_READY list, or being sent for by a worker */
+    int ready;
+    int busy;
+    
+    /* Packets queued, being sent, or waiting to be retried */
+    int held;
+    
+    /* Packet waiting to be retried, its tries so far, and when */
+    PacketDescriptor *retry;
+    int attempts;
+    long long retry_at;
+    
+    /* Chance a single try succeeds, and the tries it earns a packet */
+    double success;
+    int budget;
+    
+    /* The last try didn't get through */
+    int failing;
+    
+    /* Packets sent, tries repeated, and packets given up on */
+    unsigned long sent;
+    unsigned long retries;
+    unsigned long given_up;
+    
+    /* Next on the SND_READY or SND_RETRY list, and in the bucket */
+    DestQueue *next_ready;
+    DestQueue *next;
+};
+
+DestQueue *DESTS[DEST_BUCKETS];
+DestQueue *SND_READY;
+DestQueue *SND_READY_TAIL;
+DestQueue *SND_RETRY;
+pthread_mutex_t SND_LOCK = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t SND_WORK = PTHREAD_COND_INITIALIZER;
+pthread_cond_t SND_RETRY_DUE;
+pthread_cond_t SND_ROOM = PTHREAD_COND_INITIALIZER;
+
+/* Packets SND has taken from SND_BUF that aren't sent or given up on */
+int SND_HELD;
+
+/* Totals over all destinations, for send_stats() */
+unsigned long SND_SENT;
+unsigned long SND_RETRIES;
+unsigned long SND_GIVEN_UP;
+
+/*
+ * Table of clients, indexed directly by PID
+ * 
+ * CLIENTS[] holds chunks of CLIENT_CHUNK clients each, allocated the 
+ *     first time a PID in their range turns up and kept from then on, 
+ *     so any PID below CLIENT_PID_LIMIT is found in two steps and an 
+ *     entry never moves once handed out.
+ * 
+ * Each client's buffer is only created the first time a packet or a
+ *     request for one turns up for it. A client whose application has
+ *     not asked for anything in CLIENT_IDLE_SECS has its buffer 
+ *     emptied back into the FPDS and destroyed, so idle clients cost 
+ *     no packet descriptors; the next use creates a fresh one.
+ */
+#define CLIENT_CHUNK_BITS   10
+#define CLIENT_CHUNK        (1 << CLIENT_CHUNK_BITS)
+#define CLIENT_CHUNKS       1024
+#define CLIENT_PID_LIMIT    ((PID) CLIENT_CHUNKS * CLIENT_CHUNK)
+
+struct client
+{
+    /* Threads using buf right now, or -1 while it is being reclaimed */
+    int users;
+    
+    /* The client's buffer, or NULL until it is next needed */
+    BoundedBuffer *buf;
+    
+    /* When the application last asked for packets */
+    time_t last_used;
+};
+
+Client *CLIENTS[CLIENT_CHUNKS];
+
+/* How long before a client counts as idle, and how often to look */
+const int CLIENT_IDLE_SECS  = 30;
+const int CLIENT_SWEEP_SECS = 10;
 
 /* Pointer for the packet descriptor waiting for the network */
 PacketDescriptor *DEST;
 
-/* Pointer for the destination's replacement */
-PacketDescriptor *NEXT;
-
 /* Sentinel for whether the driver has been initialized yet */
 int INIT = 0;
 
@@ -207,7 +378,7 @@ void init_network_driver(NetworkDevice              *nd,
     
     
     /* Create the buffers */
-    SND_BUF = createBB(SND_SIZE);    
+    SND_BUF = createMPSCRB(SND_SIZE);    
     if (SND_BUF == NULL)
     {
         log_err("Could not create buffers for sending packets.");
@@ -217,33 +388,25 @@ void init_network_driver(NetworkDevice              *nd,
     log_info("Created SND_BUF at %p", SND_BUF);
     
     
-    for (i = 0; i < MAX_PID; i++)
+    RCV_TEMP = createSPSCRB(RCV_TEMP_SIZE);    
+    if (RCV_TEMP == NULL)
     {
-        /* Initialize both buffer and client PID dummy value */
-        
-        CLIENTS[i] = 0;
-        
-        GET_BUF[i] = createBB(GET_SIZE);
-        if (GET_BUF[i] == NULL)
-        {
-            log_err("Could not create one of the buffers for "
-                     "receiving packets.");
-            return;
-        }
+        log_err("Could not create buffer for holding received" 
+                "packets.");
+        return;
     }
     
-    log_info("Created GET_BUF at %p", GET_BUF[0]);
+    log_info("Created RCV_TEMP_BUF at %p", RCV_TEMP);
     
     
-    RCV_TEMP = createBB(RCV_TEMP_SIZE);    
-    if (RCV_TEMP == NULL)
+    RCV_STASH = createSPSCRB(RCV_STASH_SIZE);
+    if (RCV_STASH == NULL)
     {
-        log_err("Could not create buffer for holding received" 
-                "packets.");
+        log_err("Could not create stash for receiving packets.");
         return;
     }
     
-    log_info("Created RCV_TEMP_BUF at %p", RCV_TEMP);
+    log_info("Created RCV_STASH at %p", RCV_STASH);
     
     
     
@@ -280,6 +443,23 @@ void init_network_driver(NetworkDevice              *nd,
     
     
     
+    /* Fill the stash so an early burst finds replacements waiting */
+    for (i = 0; i < RCV_STASH_SIZE; i++)
+    {
+        PacketDescriptor *pd;
+        
+        if (!nonblocking_get_pd(FPDS, &pd))
+        {
+            break;
+        }
+        init_packet_descriptor(pd);
+        nonblockingWriteRB(RCV_STASH, pd);
+    }
+    
+    log_info("Stashed %d packets for reception", i);
+    
+    
+    
     /* Spin up the threads */
     rc = pthread_create(&SND, NULL, &snd_func, NULL);
     if (rc)
@@ -291,6 +471,36 @@ void init_network_driver(NetworkDevice              *nd,
     log_info("Spun up SND thread");
     
     
+    for (i = 0; i < SND_WORKERS; i++)
+    {
+        rc = pthread_create(&SND_POOL[i], NULL, &snd_worker, NULL);
+        if (rc)
+        {
+            log_err("Could not create sending worker: code %d;", rc);
+            return;
+        }
+    }
+    
+    log_info("Spun up %d SND_POOL workers", SND_WORKERS);
+    
+    
+    /* Retry times are on the monotonic clock, so wait on that too */
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&SND_RETRY_DUE, &attr);
+    pthread_condattr_destroy(&attr);
+    
+    rc = pthread_create(&SND_TIMER, NULL, &snd_timer, NULL);
+    if (rc)
+    {
+        log_err("Could not create retry timer thread: code %d;", rc);
+        return;
+    }
+    
+    log_info("Spun up SND_TIMER thread");
+    
+    
     rc = pthread_create(&RCV_LISTEN, NULL, &rcv_listen, NULL);
     if (rc)
     {
@@ -349,7 +559,7 @@ void blocking_send_packet(PacketDescriptor *pd)
         return;
     }
     
-    blockingWriteBB(SND_BUF, pd);
+    blockingWriteRB(SND_BUF, pd);
 }
 
 /*
@@ -377,8 +587,8 @@ int nonblocking_send_packet(PacketDescriptor *pd)
         return 1;
     }
     
-    int rc = nonblockingWriteBB(SND_BUF, pd);
-    if (rc == 1)
+    int rc = nonblockingWriteRB(SND_BUF, pd);
+    if (rc == 0)
     {
         log_info("Could not write packet to buffer (NB)");
         return 1;
@@ -390,7 +600,7 @@ int nonblocking_send_packet(PacketDescriptor *pd)
 
 /*
  * Retrieves a packet for the caller, blocking it until a packet for
- * them appears in the GET_BUF.
+ * them appears in their buffer.
  * 
  * PARAMS: 
  *     PacketDescriptor **pd
@@ -406,8 +616,9 @@ void blocking_get_packet(PacketDescriptor **pd, PID pid)
         return;
     }
     
-    int client_index = find_client(pid);
-    if (client_index == -1)
+    Client *client = find_client(pid);
+    BoundedBuffer *bb = acquire_client(client, 1);
+    if (bb == NULL)
     {
         log_err("Bad PID trying to get packet");
         return;
@@ -415,8 +626,8 @@ void blocking_get_packet(PacketDescriptor **pd, PID pid)
     
     log_info("Packet sent to application %d", pid);
     
-    BoundedBuffer *bb = GET_BUF[client_index];
     *pd = (PacketDescriptor *) blockingReadBB(bb);
+    release_client(client);
 }
 
 /*
@@ -446,17 +657,18 @@ int nonblocking_get_packet(PacketDescriptor **pd, PID pid)
         return 1;
     }
     
-    int client_index = find_client(pid);
-    if (client_index == -1)
+    Client *client = find_client(pid);
+    BoundedBuffer *bb = acquire_client(client, 1);
+    if (bb == NULL)
     {
         log_err("Bad PID trying to get packet");
         return 1;
     }
     
-    BoundedBuffer *bb = GET_BUF[client_index];
     int rc = nonblockingReadBB(bb, (void **) pd);
+    release_client(client);
     
-    if (rc == 1)
+    if (rc == 0)
     {
         log_info("Could not read packet from buffer (NB)");
         return 1;
@@ -467,49 +679,553 @@ int nonblocking_get_packet(PacketDescriptor **pd, PID pid)
     return 0;
 }
 
+/*
+ * Accepts a batch of packet descriptors for sending, in order. Waits
+ * only when the buffer fills, and then pays for the wait once per 
+ * refill rather than once per packet.
+ * 
+ * PARAMS: 
+ *     PacketDescriptor **pds
+ *         The packet descriptors to send through the network device.
+ *     int n
+ *         How many of them there are.
+ */
+void blocking_send_packets(PacketDescriptor **pds, int n)
+{
+    if (!INIT)
+    {
+        log_err("Did not initialize driver!");
+        return;
+    }
+    
+    blockingWriteManyRB(SND_BUF, (void **) pds, n);
+}
+
+/*
+ * Accepts as many of a batch of packet descriptors for sending as 
+ * there is room for. Always returns promptly. 
+ * 
+ * PARAMS: 
+ *     PacketDescriptor **pds
+ *         The packet descriptors to send through the network device.
+ *     int n
+ *         How many of them there are.
+ * 
+ * RETURN: 
+ *     0 <= r <= n
+ *         How many packets, from the start of pds, were queued for 
+ *         sending. The rest remain the caller's.
+ */
+int nonblocking_send_packets(PacketDescriptor **pds, int n)
+{
+    if (!INIT)
+    {
+        log_err("Did not initialize driver!");
+        return 0;
+    }
+    
+    int queued = nonblockingWriteManyRB(SND_BUF, (void **) pds, n);
+    
+    log_info("Wrote %d of %d packets to outgoing buffer", queued, n);
+    return queued;
+}
+
+/*
+ * Retrieves up to max packets for the caller, blocking it until at
+ * least one packet for them appears in their buffer.
+ * 
+ * PARAMS: 
+ *     PacketDescriptor **out
+ *         Filled with the packet descriptors received. 
+ *     int max
+ *         The most packets to return. 
+ *     PID pid
+ *         The PID of the application seeking packets. 
+ * 
+ * RETURN: 
+ *     1 <= r <= max
+ *         How many packets were placed at the start of out.
+ *     0 
+ *         The call failed.
+ */
+int blocking_get_packets(PacketDescriptor **out, int max, PID pid)
+{
+    if (!INIT)
+    {
+        log_err("Did not initialize driver!");
+        return 0;
+    }
+    
+    if (max <= 0)
+    {
+        return 0;
+    }
+    
+    Client *client = find_client(pid);
+    BoundedBuffer *bb = acquire_client(client, 1);
+    if (bb == NULL)
+    {
+        log_err("Bad PID trying to get packets");
+        return 0;
+    }
+    
+    int got = 1;
+    
+    out[0] = (PacketDescriptor *) blockingReadBB(bb);
+    while (got < max && nonblockingReadBB(bb, (void **) &out[got]))
+    {
+        got++;
+    }
+    release_client(client);
+    
+    log_info("%d packets sent to application %d", got, pid);
+    return got;
+}
+
+/*
+ * Retrieves up to max packets for the caller, returning promptly. 
+ * 
+ * PARAMS: 
+ *     PacketDescriptor **out
+ *         Filled with the packet descriptors received. 
+ *     int max
+ *         The most packets to return. 
+ *     PID pid
+ *         The PID of the application seeking packets. 
+ * 
+ * RETURN: 
+ *     0 <= r <= max
+ *         How many packets were placed at the start of out; 0 if 
+ *         none were waiting or the call failed.
+ */
+int nonblocking_get_packets(PacketDescriptor **out, int max, PID pid)
+{
+    if (!INIT)
+    {
+        log_err("Did not initialize driver!");
+        return 0;
+    }
+    
+    Client *client = find_client(pid);
+    BoundedBuffer *bb = acquire_client(client, 1);
+    if (bb == NULL)
+    {
+        log_err("Bad PID trying to get packets");
+        return 0;
+    }
+    
+    int got = 0;
+    
+    while (got < max && nonblockingReadBB(bb, (void **) &out[got]))
+    {
+        got++;
+    }
+    release_client(client);
+    
+    log_info("%d packets sent to application %d", got, pid);
+    return got;
+}
+
+/*
+ * Reports how sending has gone since the driver was initialized.
+ * 
+ * PARAMS:
+ *     unsigned long *sent
+ *         Set to the number of packets that got through.
+ *     unsigned long *retries
+ *         Set to the number of tries repeated after a failure.
+ *     unsigned long *given_up
+ *         Set to the number of packets dropped after running out of
+ *         tries.
+ */
+void send_stats(unsigned long *sent, 
+                unsigned long *retries, 
+                unsigned long *given_up)
+{
+    pthread_mutex_lock(&SND_LOCK);
+    *sent = SND_SENT;
+    *retries = SND_RETRIES;
+    *given_up = SND_GIVEN_UP;
+    pthread_mutex_unlock(&SND_LOCK);
+}
+
 /*-----------------------------------------------------------------*/
 /*-------------------Private Function Definitions------------------*/
 /*-----------------------------------------------------------------*/
 
 /*
- * Find which index a client occupies for the array of clients and 
- * the array of bounded buffers containing the processes for them.
+ * Find the queue for a destination, creating it if it's the first 
+ * packet for there. Must be called with SND_LOCK held.
+ * 
+ * PARAMS:
+ *     Destination dest
+ *         Where the packets are going.
+ * 
+ * RETURN:
+ *     DestQueue *
+ *         The destination's queue.
+ *     NULL 
+ *         The queue couldn't be created.
+ */
+DestQueue *find_dest(Destination dest)
+{
+    DestQueue **bucket = &DESTS[((unsigned long) dest >> 4) % DEST_BUCKETS];
+    DestQueue *dq;
+    
+    for (dq = *bucket; dq != NULL; dq = dq->next)
+    {
+        if (dq->dest == dest)
+        {
+            return dq;
+        }
+    }
+    
+    dq = (DestQueue *) calloc(1, sizeof(DestQueue));
+    if (dq == NULL || (dq->packets = create_gqueue()) == NULL)
+    {
+        free(dq);
+        return NULL;
+    }
+    dq->dest = dest;
+    dq->success = 0.5;
+    dq->budget = 5;
+    dq->next = *bucket;
+    *bucket = dq;
+    return dq;
+}
+
+/*
+ * Puts a destination with packets waiting at the end of the SND_READY
+ * list and wakes a worker for it. Must be called with SND_LOCK held.
+ * 
+ * PARAMS:
+ *     DestQueue *dq
+ *         The destination, which must be neither ready nor busy.
+ */
+void make_ready(DestQueue *dq)
+{
+    dq->ready = 1;
+    dq->next_ready = NULL;
+    if (SND_READY == NULL)
+    {
+        SND_READY = dq;
+    }
+    else
+    {
+        SND_READY_TAIL->next_ready = dq;
+    }
+    SND_READY_TAIL = dq;
+    pthread_cond_signal(&SND_WORK);
+}
+
+/*
+ * Folds the outcome of a try into the destination's success average,
+ * and works out from it how many tries a packet there has earned. 
+ * Must be called with SND_LOCK held.
+ * 
+ * PARAMS:
+ *     DestQueue *dq
+ *         The destination tried.
+ *     int rc
+ *         What send_packet() returned: 1 if the try got through.
+ */
+void record_attempt(DestQueue *dq, int rc)
+{
+    double fail = 1.0;
+    int tries = 0;
+    
+    dq->failing = (rc != 1);
+    dq->success += ((rc == 1) - dq->success) / 16;
+    
+    while (tries < SND_MAX_TRIES && fail > 0.05)
+    {
+        fail *= 1 - dq->success;
+        tries++;
+    }
+    
+    if (fail > 0.5 || tries < SND_MIN_TRIES)
+    {
+        tries = SND_MIN_TRIES;
+    }
+    dq->budget = tries;
+}
+
+/*
+ * Parks a packet whose send failed at the head of its destination, 
+ * and puts the destination on the SND_RETRY list to be made ready 
+ * again after a backoff. Must be called with SND_LOCK held.
+ * 
+ * PARAMS:
+ *     DestQueue *dq
+ *         The packet's destination, which must be neither ready nor
+ *         busy.
+ *     PacketDescriptor *pd
+ *         The packet.
+ *     int attempts
+ *         How many times it has been tried.
+ *     unsigned int *seed
+ *         The calling worker's random seed, for the jitter.
+ */
+void schedule_retry(DestQueue *dq, PacketDescriptor *pd, int attempts, 
+                    unsigned int *seed)
+{
+    long delay = SND_RETRY_MAX_MS;
+    DestQueue **link;
+    
+    if (attempts <= 8 && (SND_RETRY_BASE_MS << (attempts - 1)) < delay)
+    {
+        delay = SND_RETRY_BASE_MS << (attempts - 1);
+    }
+    delay = delay * 1000000 / 2 + rand_r(seed) % (delay * 1000000 / 2 + 1);
+    
+    dq->retry = pd;
+    dq->attempts = attempts;
+    dq->retry_at = now_ns() + delay;
+    
+    /* Keep the list in the order retries fall due */
+    for (link = &SND_RETRY; *link != NULL; link = &(*link)->next_ready)
+    {
+        if ((*link)->retry_at > dq->retry_at)
+        {
+            break;
+        }
+    }
+    dq->next_ready = *link;
+    *link = dq;
+    
+    /* The timer only needs to know if this is the next one due */
+    if (SND_RETRY == dq)
+    {
+        pthread_cond_signal(&SND_RETRY_DUE);
+    }
+}
+
+/*
+ * Reads the monotonic clock
  * 
- * If it finds a value of 0 in the CLIENTS[] array instead, it 
- * instantiates that PID into CLIENTS[]. 
+ * RETURN:
+ *     long long
+ *         Nanoseconds since some fixed point.
+ */
+long long now_ns(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Find the client entry for a PID, allocating the chunk of the table
+ * it lives in if this is the first PID in that range. Two threads 
+ * allocating the same chunk race to publish it, and the loser frees 
+ * its copy.
  * 
  * PARAMS:
  *     PID pid
  *         The PID of the client application.
  * 
  * RETURN:
- *     0 <= r < MAX_PID
- *         The index linking the CLIENTS[] to their GET_BUF[].
- *     -1 
- *         The call failed for some reason, likely due to a bad PID.
+ *     Client *
+ *         The client's entry, which stays put for as long as the 
+ *         driver runs.
+ *     NULL 
+ *         The PID is out of range, or the chunk couldn't be allocated.
  */
-int find_client(PID pid)
+Client *find_client(PID pid)
 {
-    /* The index */
-    int i; 
+    if (pid >= CLIENT_PID_LIMIT)
+    {
+        return NULL;
+    }
     
-    for (i = 0; i < MAX_PID; i++)
+    Client **slot = &CLIENTS[pid >> CLIENT_CHUNK_BITS];
+    Client *chunk = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    
+    if (chunk == NULL)
     {
-        if (CLIENTS[i] == 0)
+        Client *fresh = (Client *) calloc(CLIENT_CHUNK, sizeof(Client));
+        if (fresh == NULL)
         {
-            /* Empty spaces - fill with new client */
-            CLIENTS[i] = pid;
-            return i;
-        } 
-        else if (CLIENTS[i] == pid) 
+            return NULL;
+        }
+        
+        if (__atomic_compare_exchange_n(slot, &chunk, fresh, 0, 
+                                        __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE))
+        {
+            chunk = fresh;
+        }
+        else
         {
-            /* Found the client */
-            return i;
+            /* Somebody else got there first; chunk now holds theirs */
+            free(fresh);
         }
     }
     
-    /* Found neither empty space nor the client - failure */
-    return -1;
+    return &chunk[pid & (CLIENT_CHUNK - 1)];
+}
+
+/*
+ * Registers the caller as a user of the client's buffer, creating the
+ * buffer if the client doesn't have one. The buffer can't be reclaimed
+ * until the matching release_client().
+ * 
+ * PARAMS:
+ *     Client *client
+ *         The client, as returned by find_client(); may be NULL.
+ *     int app
+ *         Nonzero if the caller is the client's application asking for
+ *         packets, which keeps the client from counting as idle; 
+ *         deliveries from RCV_PROCESS don't.
+ * 
+ * RETURN:
+ *     BoundedBuffer *
+ *         The client's buffer.
+ *     NULL 
+ *         The client was NULL or a buffer couldn't be created; no 
+ *         release_client() is needed.
+ */
+BoundedBuffer *acquire_client(Client *client, int app)
+{
+    if (client == NULL)
+    {
+        return NULL;
+    }
+    
+    /* Count ourselves in, waiting out a reclaim if one is under way */
+    int users = __atomic_load_n(&client->users, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        if (users < 0)
+        {
+            sched_yield();
+            users = __atomic_load_n(&client->users, __ATOMIC_RELAXED);
+        }
+        else if (__atomic_compare_exchange_n(&client->users, &users, 
+                                             users + 1, 1,
+                                             __ATOMIC_ACQUIRE,
+                                             __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+    
+    /* Stored while counted in, so a reclaim that shuts us out after
+       we let go sees it */
+    if (app)
+    {
+        __atomic_store_n(&client->last_used, time(NULL), __ATOMIC_RELAXED);
+    }
+    
+    BoundedBuffer *bb = __atomic_load_n(&client->buf, __ATOMIC_ACQUIRE);
+    if (bb == NULL)
+    {
+        BoundedBuffer *fresh = createBB(GET_SIZE);
+        if (fresh == NULL)
+        {
+            log_err("Could not create a buffer for receiving packets.");
+            release_client(client);
+            return NULL;
+        }
+        
+        if (__atomic_compare_exchange_n(&client->buf, &bb, fresh, 0, 
+                                        __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE))
+        {
+            bb = fresh;
+            __atomic_store_n(&client->last_used, time(NULL), 
+                             __ATOMIC_RELAXED);
+        }
+        else
+        {
+            destroyBB(fresh);
+        }
+    }
+    
+    return bb;
+}
+
+/*
+ * Drops the caller's use of the client's buffer
+ * 
+ * PARAMS:
+ *     Client *client
+ *         The client passed to a successful acquire_client().
+ */
+void release_client(Client *client)
+{
+    __atomic_sub_fetch(&client->users, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Empties and destroys the buffers of clients nobody is using whose
+ * applications haven't asked for a packet in CLIENT_IDLE_SECS, handing
+ * their packets back to the FPDS. Does nothing if it last looked less
+ * than CLIENT_SWEEP_SECS ago. Called from the RCV_PROCESS thread only.
+ */
+void reclaim_idle_clients(void)
+{
+    static time_t last_sweep = 0;
+    time_t now = time(NULL);
+    int c, i;
+    
+    if (now - last_sweep < CLIENT_SWEEP_SECS)
+    {
+        return;
+    }
+    last_sweep = now;
+    
+    for (c = 0; c < CLIENT_CHUNKS; c++)
+    {
+        Client *chunk = __atomic_load_n(&CLIENTS[c], __ATOMIC_ACQUIRE);
+        if (chunk == NULL)
+        {
+            continue;
+        }
+        
+        for (i = 0; i < CLIENT_CHUNK; i++)
+        {
+            Client *client = &chunk[i];
+            int idle = 0;
+            
+            if (__atomic_load_n(&client->buf, __ATOMIC_RELAXED) == NULL
+                || now - __atomic_load_n(&client->last_used, 
+                                         __ATOMIC_RELAXED) 
+                   < CLIENT_IDLE_SECS)
+            {
+                continue;
+            }
+            
+            /* Shut out new users, but only if there are none now */
+            if (!__atomic_compare_exchange_n(&client->users, &idle, -1, 
+                                             0, __ATOMIC_ACQUIRE,
+                                             __ATOMIC_RELAXED))
+            {
+                continue;
+            }
+            
+            /* The application may have asked since we looked */
+            if (now - __atomic_load_n(&client->last_used, __ATOMIC_RELAXED)
+                < CLIENT_IDLE_SECS)
+            {
+                __atomic_store_n(&client->users, 0, __ATOMIC_RELEASE);
+                continue;
+            }
+            
+            PacketDescriptor *pd;
+            while (nonblockingReadBB(client->buf, (void **) &pd))
+            {
+                blocking_put_pd(FPDS, pd);
+            }
+            destroyBB(client->buf);
+            client->buf = NULL;
+            __atomic_store_n(&client->users, 0, __ATOMIC_RELEASE);
+            
+            log_info("Reclaimed idle client %d", 
+                     (c << CLIENT_CHUNK_BITS) + i);
+        }
+    }
 }
 
 /*
@@ -517,39 +1233,205 @@ int find_client(PID pid)
  */
 void *snd_func(UNUSED void *args)
 {    
-    /* Take items from the SND_BUF and pass them to the network */
+    /* Everything queued since the last time round */
+    PacketDescriptor *batch[SND_SIZE];
+    
+    /* Take items from the SND_BUF and sort them by destination */
+    while (!QUIT)
+    {
+        int room, n, i;
+        
+        /* Only take on as many packets as the senders may hold */
+        pthread_mutex_lock(&SND_LOCK);
+        while (!QUIT && SND_HELD >= SND_HELD_SIZE)
+        {
+            pthread_cond_wait(&SND_ROOM, &SND_LOCK);
+        }
+        room = SND_HELD_SIZE - SND_HELD;
+        pthread_mutex_unlock(&SND_LOCK);
+        if (QUIT)
+        {
+            break;
+        }
+        
+        /* Wait for the next packets */
+        n = blockingReadManyRB(SND_BUF, (void **) batch, 
+                               (room < SND_SIZE) ? room : SND_SIZE);
+        
+        pthread_mutex_lock(&SND_LOCK);
+        SND_HELD += n;
+        for (i = 0; i < n; i++)
+        {
+            PacketDescriptor *pd = batch[i];
+            DestQueue *dq = 
+                find_dest(packet_descriptor_get_destination(pd));
+            
+            /* A full destination that's failing gives up its oldest
+               waiting packet rather than holding up everything behind
+               it; one that's only busy queues past its share, and 
+               SND_HELD_SIZE pushes back on the applications */
+            PacketDescriptor *old;
+            if (dq != NULL && dq->held >= DEST_QUEUE_SIZE && dq->failing
+                && gqueue_dequeue(dq->packets, (void **) &old))
+            {
+                dq->given_up++;
+                SND_GIVEN_UP++;
+                log_err("Gave up on packet %p, its destination is full", 
+                        old);
+                dq->held--;
+                SND_HELD--;
+                blocking_put_pd(FPDS, old);
+            }
+            
+            if (dq == NULL || !gqueue_enqueue(dq->packets, pd))
+            {
+                log_err("Could not queue packet %p for sending", pd);
+                SND_HELD--;
+                blocking_put_pd(FPDS, pd);
+                continue;
+            }
+            dq->held++;
+            
+            /* Hand the destination to a worker unless one has it, or
+               it's waiting to retry */
+            if (!dq->ready && !dq->busy && dq->retry == NULL)
+            {
+                make_ready(dq);
+            }
+        }
+        pthread_mutex_unlock(&SND_LOCK);
+    }
+    
+    /* QUIT has been set, so return to rejoin parent */
+    return NULL;
+}
+
+/*
+ * Function tethered to each SND_POOL thread
+ */
+void *snd_worker(UNUSED void *args)
+{
+    /* For the retry jitter; rand() would disturb the device's */
+    unsigned int seed = (unsigned int) pthread_self();
+    
+    pthread_mutex_lock(&SND_LOCK);
     while (!QUIT)
     {
-        /* Wait for the next packet */
-        PacketDescriptor *pd = 
-            (PacketDescriptor *) blockingReadBB(SND_BUF);
+        /* Wait for a destination with packets waiting */
+        if (SND_READY == NULL)
+        {
+            pthread_cond_wait(&SND_WORK, &SND_LOCK);
+            continue;
+        }
         
-        /* Try to send the packet three times */
-        int attempts = 0
-        int rc = 0;
-        while((attempts < 5) && (rc == 0))
+        DestQueue *dq = SND_READY;
+        SND_READY = dq->next_ready;
+        dq->ready = 0;
+        dq->busy = 1;
+        
+        /* A packet being retried goes before anything newer */
+        PacketDescriptor *pd;
+        int attempts = 0;
+        if (dq->retry != NULL)
+        {
+            pd = dq->retry;
+            attempts = dq->attempts;
+            dq->retry = NULL;
+        }
+        else
         {
-            rc = send_packet(ND, pd);
-            attempts++;
+            gqueue_dequeue(dq->packets, (void **) &pd);
         }
+        pthread_mutex_unlock(&SND_LOCK);
+        
+        /* Try to send the packet once */
+        int rc = send_packet(ND, pd);
+        attempts++;
+        
+        pthread_mutex_lock(&SND_LOCK);
+        record_attempt(dq, rc);
+        dq->busy = 0;
         
         /* Interpret the results */
+        PacketDescriptor *done = NULL;
         if (rc == 1)
         {
+            dq->sent++;
+            SND_SENT++;
             log_info("Successfully sent packet %p after %d tries",
                      pd,
                      attempts);
+            done = pd;
         } 
-        else 
+        else if (attempts >= dq->budget)
         {
+            dq->given_up++;
+            SND_GIVEN_UP++;
             log_err("Failed to send packet %p after %d tries", 
                     pd, 
                     attempts);
+            done = pd;
+        }
+        else
+        {
+            dq->retries++;
+            SND_RETRIES++;
+            schedule_retry(dq, pd, attempts, &seed);
         }
         
-        /* Return packet descriptor to the FPDS */
-        blocking_put_pd(FPDS, pd);
+        /* Let the destination's next packet wait its turn */
+        if (dq->retry == NULL && gqueue_length(dq->packets) > 0)
+        {
+            make_ready(dq);
+        }
+        
+        /* Return packet descriptor to the FPDS, making room for SND */
+        if (done != NULL)
+        {
+            dq->held--;
+            SND_HELD--;
+            pthread_cond_signal(&SND_ROOM);
+            pthread_mutex_unlock(&SND_LOCK);
+            blocking_put_pd(FPDS, done);
+            pthread_mutex_lock(&SND_LOCK);
+        }
     }
+    pthread_mutex_unlock(&SND_LOCK);
+    
+    /* QUIT has been set, so return to rejoin parent */
+    return NULL;
+}
+
+/*
+ * Function tethered to the SND_TIMER thread
+ */
+void *snd_timer(UNUSED void *args)
+{
+    pthread_mutex_lock(&SND_LOCK);
+    while (!QUIT)
+    {
+        /* Sleep until the next retry falls due, or one is added */
+        if (SND_RETRY == NULL)
+        {
+            pthread_cond_wait(&SND_RETRY_DUE, &SND_LOCK);
+            continue;
+        }
+        
+        if (SND_RETRY->retry_at > now_ns())
+        {
+            struct timespec due;
+            due.tv_sec = SND_RETRY->retry_at / 1000000000LL;
+            due.tv_nsec = SND_RETRY->retry_at % 1000000000LL;
+            pthread_cond_timedwait(&SND_RETRY_DUE, &SND_LOCK, &due);
+            continue;
+        }
+        
+        /* Due - hand it back to the workers */
+        DestQueue *dq = SND_RETRY;
+        SND_RETRY = dq->next_ready;
+        make_ready(dq);
+    }
+    pthread_mutex_unlock(&SND_LOCK);
     
     /* QUIT has been set, so return to rejoin parent */
     return NULL;
@@ -560,30 +1442,31 @@ void *snd_func(UNUSED void *args)
  */
 void *rcv_listen(UNUSED void *args)
 {
+    /* Replacement for DEST, held over if it couldn't be used */
+    PacketDescriptor *spare = NULL;
+    
     /* Constantly listen to the network for incoming packets */
     while (!QUIT)
     {
         await_incoming_packet(ND);
         
         /* DEVNOTE: KEEP THIS FAST AS POSSIBLE! */
-       
-        if (nonblockingWriteBB(RCV_TEMP, DEST) == 0)
+        
+        /* Only give DEST away once there's something to replace it */
+        if (spare == NULL)
+        {
+            nonblockingReadRB(RCV_STASH, (void **) &spare);
+        }
+        
+        if (spare == NULL || nonblockingWriteRB(RCV_TEMP, DEST) == 0)
         {
-            /* Writing incoming packet failed, scrub DEST */
+            /* No replacement or nowhere to put it, scrub DEST */
             init_packet_descriptor(DEST);
         } 
         else 
         {
-            /* Ensure NEXT has gotten a new value */
-            while (NEXT == NULL)
-            {
-                /* Force a context switch */
-                sleep(0);
-            }
-            
-            /* Replace the destination, and nullify the next */
-            DEST = NEXT;
-            NEXT = NULL;
+            DEST = spare;
+            spare = NULL;
         }
         
         register_receiving_packetdescriptor(ND, DEST);
@@ -597,30 +1480,49 @@ void *rcv_listen(UNUSED void *args)
  */
 void *rcv_process(UNUSED void *args)
 {
+    /* Everything received since the last time round */
+    PacketDescriptor *batch[RCV_TEMP_SIZE];
+    
     /* Look for and sort any items in the RCV_TEMP buffer */
     while (!QUIT)
     {
-        /* Grab the packet from the intermediate buffer */
-        PacketDescriptor *pd = 
-            (PacketDescriptor *) blockingReadBB(RCV_TEMP);
-        
-        /* Get its PID to find the right buffer to write to */
-        PID pid = packet_descriptor_get_pid(pd);
-        int client_index = find_client(pid);
-        BoundedBuffer *bb = GET_BUF[client_index];
+        /* Grab the packets from the intermediate buffer */
+        int n = blockingReadManyRB(RCV_TEMP, (void **) batch, 
+                                   RCV_TEMP_SIZE);
+        int i;
         
-        /* If write fails, overwrite oldest */
-        while (nonblockingWriteBB(bb, pd) == 0)
+        for (i = 0; i < n; i++)
         {
-            /* Grab the oldest packet */
-            PacketDescriptor *temp = 
-                (PacketDescriptor *) blockingReadBB(bb);
+            PacketDescriptor *pd = batch[i];
             
-            /* Return 'dropped' packet to FPDS */
-            blocking_put_pd(FPDS, temp);
+            /* Get its PID to find the right buffer to write to */
+            PID pid = packet_descriptor_get_pid(pd);
+            Client *client = find_client(pid);
+            BoundedBuffer *bb = acquire_client(client, 0);
+            if (bb == NULL)
+            {
+                log_err("Dropped packet %p for bad PID %d", pd, pid);
+                blocking_put_pd(FPDS, pd);
+                continue;
+            }
             
-            /* Terminate loop, let while conditional handle it */
+            /* If write fails, overwrite oldest */
+            while (nonblockingWriteBB(bb, pd) == 0)
+            {
+                /* Grab the oldest packet, unless it was just taken */
+                PacketDescriptor *temp;
+                if (nonblockingReadBB(bb, (void **) &temp))
+                {
+                    /* Return 'dropped' packet to FPDS */
+                    blocking_put_pd(FPDS, temp);
+                }
+                
+                /* Terminate loop, let while conditional handle it */
+            }
+            release_client(client);
         }
+        
+        reclaim_idle_clients();
     }
     
     return NULL;
@@ -631,13 +1533,37 @@ void *rcv_process(UNUSED void *args)
  */
 void *rcv_upkeep(UNUSED void *args)
 {
-    /* Constantly try to add new packets from FPDS to RCV_PDS */
+    /* Packet taken from the FPDS but not yet stashed */
+    PacketDescriptor *pd = NULL;
+    
+    /* Keep RCV_STASH full of packets from the FPDS */
     while (!QUIT)
     {
-        if (NEXT == NULL)
+        if (pd == NULL)
         {
-            blocking_get_pd(FPDS, &NEXT);
-            init_packet_descriptor(NEXT);
+            blocking_get_pd(FPDS, &pd);
+            init_packet_descriptor(pd);
+        }
+        
+        /* Sleeps here until RCV_LISTEN takes from a full stash */
+        blockingWriteRB(RCV_STASH, pd);
+        pd = NULL;
+        
+        /* Top up whatever else has been taken in the meantime */
+        for (;;)
+        {
+            if (!nonblocking_get_pd(FPDS, &pd))
+            {
+                pd = NULL;
+                break;
+            }
+            init_packet_descriptor(pd);
+            if (!nonblockingWriteRB(RCV_STASH, pd))
+            {
+                /* Full again; keep this one for the next round */
+                break;
+            }
+            pd = NULL;
         }
     }
     
@@ -717,21 +1643,83 @@ void cleanup()
     /* Throwaway index for looping */
     int i;
     
+    /* Throwaway pointer for draining the stash */
+    PacketDescriptor *pd;
+    
     /* Set the quitting time sentinel to make threads terminate */
     QUIT = 1;
     
+    /* Wake the idle senders and the retry timer so they notice */
+    pthread_mutex_lock(&SND_LOCK);
+    pthread_cond_broadcast(&SND_WORK);
+    pthread_cond_signal(&SND_RETRY_DUE);
+    pthread_cond_signal(&SND_ROOM);
+    pthread_mutex_unlock(&SND_LOCK);
+    
     /* Join the threads */
     pthread_join(SND, NULL);
+    for (i = 0; i < SND_WORKERS; i++)
+    {
+        pthread_join(SND_POOL[i], NULL);
+    }
+    pthread_join(SND_TIMER, NULL);
     pthread_join(RCV_LISTEN, NULL);
     pthread_join(RCV_PROCESS, NULL);
     pthread_join(RCV_UPKEEP, NULL);
     
+    /* Hand any stashed packets back to the FPDS */
+    while (nonblockingReadRB(RCV_STASH, (void **) &pd))
+    {
+        blocking_put_pd(FPDS, pd);
+    }
+    
     /* Clean the bounded buffers */
-    destroyBB(SND_BUF);
-    destroyBB(RCV_TEMP);
-    for (i = 0; i < MAX_PID; i++)
+    destroyRB(SND_BUF);
+    destroyRB(RCV_TEMP);
+    destroyRB(RCV_STASH);
+    for (i = 0; i < CLIENT_CHUNKS; i++)
+    {
+        int j;
+        
+        if (CLIENTS[i] == NULL)
+        {
+            continue;
+        }
+        
+        for (j = 0; j < CLIENT_CHUNK; j++)
+        {
+            if (CLIENTS[i][j].buf != NULL)
+            {
+                destroyBB(CLIENTS[i][j].buf);
+            }
+        }
+        free(CLIENTS[i]);
+        CLIENTS[i] = NULL;
+    }
+    
+    pthread_cond_destroy(&SND_RETRY_DUE);
+    for (i = 0; i < DEST_BUCKETS; i++)
     {
-        destroyBB(GET_BUF[i]);
+        while (DESTS[i] != NULL)
+        {
+            DestQueue *dq = DESTS[i];
+            
+            DESTS[i] = dq->next;
+            log_info("Destination %p: sent %lu, retried %lu, gave up "
+                     "on %lu; %.0f%% of tries got through, budget %d",
+                     dq->dest, dq->sent, dq->retries, dq->given_up,
+                     dq->success * 100, dq->budget);
+            if (dq->retry != NULL)
+            {
+                blocking_put_pd(FPDS, dq->retry);
+            }
+            while (gqueue_dequeue(dq->packets, (void **) &pd))
+            {
+                blocking_put_pd(FPDS, pd);
+            }
+            destroy_gqueue(dq->packets);
+            free(dq);
+        }
     }
     
     /*
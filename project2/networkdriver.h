@@ -58,6 +58,27 @@ int  nonblocking_get_packet(PacketDescriptor **pd, PID pid);
 /* is waiting uncollected for the same PID. i.e. applications must */
 /* collect their packets reasonably promptly, or risk packet loss. */
 
+void blocking_send_packets(PacketDescriptor **pds, int n);
+int  nonblocking_send_packets(PacketDescriptor **pds, int n);
+int  blocking_get_packets(PacketDescriptor **out, int max, PID pid);
+int  nonblocking_get_packets(PacketDescriptor **out, int max, PID pid);
+/* Batched forms of the calls above, for applications that send or */
+/* collect many packets at a time. The send calls pay buffer       */
+/* synchronization once per batch rather than once per packet, and */
+/* take the packets in order; the nonblocking one returns how many */
+/* from the front of the batch it accepted. The get calls only     */
+/* save the per-packet client lookup; each packet still takes the  */
+/* client's buffer lock. They return how many packets (at most     */
+/* max) were placed at the front of out; the blocking one waits    */
+/* for at least one.                                               */
+
+void send_stats(unsigned long *sent, unsigned long *retries,
+                unsigned long *given_up);
+/* Reports, since initialisation, how many packets have been sent, */
+/* how many failed tries have been scheduled to be tried again     */
+/* after a backoff, and how many packets were given up on once     */
+/* their destination's retry budget ran out.                       */
+
 void init_network_driver(NetworkDevice               *nd, 
                          void                        *mem_start, 
                          unsigned long               mem_length,